@@ -0,0 +1,49 @@
+#include "ColorFader.h"
+
+using namespace common;
+
+namespace ledpi {
+
+ColorFader::ColorFader(uv::Loop &loop, std::chrono::milliseconds period, const ColorMixer &mixer, SetFunc set)
+    : loop_(loop), timer_(loop), period_(period), mixer_(mixer), set_(std::move(set)) {}
+
+void ColorFader::start(Color from, Color to, std::chrono::milliseconds duration, Easing easing) {
+  // From or to off, only the intensity changes
+  if(from.intensity <= 0) {
+    from.x = to.x;
+    from.y = to.y;
+  } else if(to.intensity <= 0) {
+    to.x = from.x;
+    to.y = from.y;
+  }
+  from_ = from;
+  to_ = to;
+  start_ = loop_.now();
+  duration_ = std::chrono::duration_cast<uv::Clock::duration>(duration);
+  easing_ = easing;
+  target_ = mixer_.lookup(to.x, to.y, to.intensity);
+  if(!active_) {
+    active_ = true;
+    timer_.start([this]() { tick(); }, period_, period_);
+  }
+}
+
+void ColorFader::cancel() {
+  if(!active_) return;
+  active_ = false;
+  timer_.stop();
+}
+
+void ColorFader::tick() {
+  auto elapsed = loop_.now() - start_;
+  if(elapsed >= duration_) {
+    cancel();
+    set_(target_);
+    return;
+  }
+  double t = ease(easing_, static_cast<float>(elapsed.count()) / duration_.count());
+  set_(mixer_.lookup(from_.x + t * (to_.x - from_.x), from_.y + t * (to_.y - from_.y),
+                     from_.intensity + t * (to_.intensity - from_.intensity)));
+}
+
+}
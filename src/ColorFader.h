@@ -0,0 +1,58 @@
+#ifndef LEDPI_COLOR_FADER_H
+#define LEDPI_COLOR_FADER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "ColorMixer.h"
+#include "Fader.h"
+#include "Uv.h"
+
+namespace ledpi {
+
+// Fades the channels a ColorMixer drives through color space. Each tick looks
+// up the mix for the chromaticity and intensity part of the way along, so the
+// light passes through the colors in between rather than whatever the
+// channels' straight-line levels happen to mix.
+class ColorFader {
+public:
+  // Levels of the mixable channels, indexed by channel
+  typedef std::function<void(const std::vector<uint16_t> &levels)> SetFunc;
+
+  struct Color {
+    double x, y;  // CIE 1931 chromaticity
+    double intensity;
+  };
+
+private:
+  common::uv::Loop &loop_;
+  common::uv::Timer timer_;
+  std::chrono::milliseconds period_;
+  const ColorMixer &mixer_;
+  SetFunc set_;
+  bool active_ = false;
+  Color from_, to_;
+  common::uv::Clock::time_point start_;
+  common::uv::Clock::duration duration_;
+  Easing easing_;
+  std::vector<uint16_t> target_;
+
+  void tick();
+
+public:
+  ColorFader(common::uv::Loop &loop, std::chrono::milliseconds period, const ColorMixer &mixer, SetFunc set);
+
+  void start(Color from, Color to, std::chrono::milliseconds duration, Easing easing);
+  void cancel();
+  bool active() const { return active_; }
+  // Levels an active fade ends at
+  const std::vector<uint16_t> &target() const { return target_; }
+
+  void close() { timer_.close(); }
+};
+
+}
+
+#endif
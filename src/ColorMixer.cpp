@@ -0,0 +1,345 @@
+#include "ColorMixer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+
+#include "state.capnp.h"
+
+namespace ledpi {
+
+namespace {
+// CIE 1931 2-degree color matching functions at 5 nm steps, 400 to 700 nm
+constexpr double CMF[ColorMixer::BUCKETS + 1][3] = {
+  {0.01431, 0.000396, 0.06785}, {0.02319, 0.00064, 0.1102}, {0.04351, 0.00121, 0.2074},
+  {0.07763, 0.00218, 0.3713}, {0.13438, 0.004, 0.6456}, {0.21477, 0.0073, 1.03905},
+  {0.2839, 0.0116, 1.3856}, {0.3285, 0.01684, 1.62296}, {0.34828, 0.023, 1.74706},
+  {0.34806, 0.0298, 1.7826}, {0.3362, 0.038, 1.77211}, {0.3187, 0.048, 1.7441},
+  {0.2908, 0.06, 1.6692}, {0.2511, 0.0739, 1.5281}, {0.19536, 0.09098, 1.28764},
+  {0.1421, 0.1126, 1.0419}, {0.09564, 0.13902, 0.81295}, {0.05795, 0.1693, 0.6162},
+  {0.03201, 0.20802, 0.46518}, {0.0147, 0.2586, 0.3533}, {0.0049, 0.323, 0.272},
+  {0.0024, 0.4073, 0.2123}, {0.0093, 0.503, 0.1582}, {0.0291, 0.6082, 0.1117},
+  {0.06327, 0.71, 0.07825}, {0.1096, 0.7932, 0.05725}, {0.1655, 0.862, 0.04216},
+  {0.22575, 0.91485, 0.02984}, {0.2904, 0.954, 0.0203}, {0.3597, 0.9803, 0.0134},
+  {0.43345, 0.99495, 0.00875}, {0.51205, 1.0, 0.00575}, {0.5945, 0.995, 0.0039},
+  {0.6784, 0.9786, 0.00275}, {0.7621, 0.952, 0.0021}, {0.8425, 0.9154, 0.0018},
+  {0.9163, 0.87, 0.00165}, {0.9786, 0.8163, 0.0014}, {1.0263, 0.757, 0.0011},
+  {1.0567, 0.6949, 0.001}, {1.0622, 0.631, 0.0008}, {1.0456, 0.5668, 0.0006},
+  {1.0026, 0.503, 0.00034}, {0.9384, 0.4412, 0.00024}, {0.85445, 0.381, 0.00019},
+  {0.7514, 0.321, 0.0001}, {0.6424, 0.265, 0.00005}, {0.5419, 0.217, 0.00003},
+  {0.4479, 0.175, 0.00002}, {0.3608, 0.1382, 0.00001}, {0.2835, 0.107, 0},
+  {0.2187, 0.0816, 0}, {0.1649, 0.061, 0}, {0.1212, 0.04458, 0},
+  {0.0874, 0.032, 0}, {0.0636, 0.0232, 0}, {0.04677, 0.017, 0},
+  {0.0329, 0.01192, 0}, {0.0227, 0.00821, 0}, {0.01584, 0.005723, 0},
+  {0.011359, 0.004102, 0},
+};
+
+// Weight of the penalty on levels, relative to a full-power channel's light
+constexpr double REGULARIZATION = 1e-4;
+
+// Grid extent, covering the spectral locus. Its bottom row keeps clear of
+// y = 0, where there is no color.
+constexpr double TABLE_X = 0.75;
+constexpr double TABLE_Y = 0.85;
+constexpr double TABLE_Y_MIN = 0.005;
+
+// Bump when the table's contents change meaning
+constexpr uint64_t TABLE_VERSION = 1;
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  auto bytes = static_cast<const unsigned char *>(data);
+  for(size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+double clamp(double value, double low, double high) {
+  return std::min(std::max(value, low), high);
+}
+
+typedef std::vector<double> Vector;
+typedef std::vector<Vector> Matrix;
+
+// Solve the symmetric positive definite system a x = b in place, by Cholesky
+void solve(Matrix a, Vector &b) {
+  size_t n = b.size();
+  for(size_t j = 0; j < n; ++j) {
+    for(size_t k = 0; k < j; ++k) a[j][j] -= a[j][k] * a[j][k];
+    a[j][j] = std::sqrt(a[j][j]);
+    for(size_t i = j + 1; i < n; ++i) {
+      for(size_t k = 0; k < j; ++k) a[i][j] -= a[i][k] * a[j][k];
+      a[i][j] /= a[j][j];
+    }
+  }
+  for(size_t i = 0; i < n; ++i) {
+    for(size_t k = 0; k < i; ++k) b[i] -= a[i][k] * b[k];
+    b[i] /= a[i][i];
+  }
+  for(size_t i = n; i-- > 0;) {
+    for(size_t k = i + 1; k < n; ++k) b[i] -= a[k][i] * b[k];
+    b[i] /= a[i][i];
+  }
+}
+
+// Minimize x'gx/2 - h'x over x >= 0, g positive definite: Lawson and Hanson's
+// active set method on the normal equations
+Vector nnls(const Matrix &g, const Vector &h) {
+  const size_t n = h.size();
+  const double tol = 1e-12;
+  Vector x(n, 0);
+  std::vector<bool> passive(n, false);
+
+  for(size_t iteration = 0; iteration < 3 * n; ++iteration) {
+    // Most promising variable still held at zero
+    size_t best = n;
+    double best_gradient = tol;
+    for(size_t j = 0; j < n; ++j) {
+      if(passive[j]) continue;
+      double gradient = h[j];
+      for(size_t k = 0; k < n; ++k) gradient -= g[j][k] * x[k];
+      if(gradient > best_gradient) {
+        best = j;
+        best_gradient = gradient;
+      }
+    }
+    if(best == n) break;
+    passive[best] = true;
+
+    while(true) {
+      std::vector<size_t> index;
+      for(size_t j = 0; j < n; ++j) {
+        if(passive[j]) index.push_back(j);
+      }
+      Matrix gp(index.size(), Vector(index.size()));
+      Vector z(index.size());
+      for(size_t a = 0; a < index.size(); ++a) {
+        for(size_t b = 0; b < index.size(); ++b) gp[a][b] = g[index[a]][index[b]];
+        z[a] = h[index[a]];
+      }
+      solve(gp, z);
+
+      // Step as far towards z as keeps x feasible
+      double alpha = 1;
+      for(size_t a = 0; a < index.size(); ++a) {
+        size_t j = index[a];
+        if(z[a] <= tol) alpha = std::min(alpha, x[j] / (x[j] - z[a]));
+      }
+      for(size_t a = 0; a < index.size(); ++a) {
+        size_t j = index[a];
+        x[j] += alpha * (z[a] - x[j]);
+        if(alpha < 1 && x[j] <= tol) {
+          x[j] = 0;
+          passive[j] = false;
+        }
+      }
+      if(alpha >= 1) break;
+    }
+  }
+  return x;
+}
+}
+
+constexpr size_t ColorMixer::BUCKETS;
+constexpr size_t ColorMixer::TABLE_SIZE;
+
+ColorMixer::ColorMixer(capnp::List<Channel>::Reader channels) : channels_(channels.size(), XYZ{}) {
+  hash_ = fnv1a(0xcbf29ce484222325ull, &TABLE_VERSION, sizeof(TABLE_VERSION));
+  for(size_t c = 0; c < channels.size(); ++c) {
+    auto spectra = channels[c].getSpectra();
+    uint64_t size = spectra.size();
+    hash_ = fnv1a(hash_, &size, sizeof(size));
+    for(float value : spectra) hash_ = fnv1a(hash_, &value, sizeof(value));
+
+    if(spectra.size() == 0) continue;
+    if(spectra.size() != BUCKETS) {
+      fprintf(stderr, "channel %s: %zu spectra buckets rather than %zu, not mixing colors with it\n",
+              channels[c].getName().cStr(), static_cast<size_t>(spectra.size()), BUCKETS);
+      continue;
+    }
+    // Each bucket is weighted by the matching functions at its middle
+    for(size_t i = 0; i < BUCKETS; ++i) {
+      for(size_t k = 0; k < 3; ++k) {
+        channels_[c][k] += spectra[i] * (CMF[i][k] + CMF[i + 1][k]) / 2;
+      }
+    }
+    if(channels_[c][1] > 0) {
+      index_.push_back(c);
+    } else {
+      channels_[c] = XYZ{};
+    }
+  }
+  for(auto channel : channels) corrections_.emplace_back(channel);
+}
+
+std::vector<uint16_t> ColorMixer::mix(double x, double y, double intensity) const {
+  auto levels = solve(x, y, intensity);
+  for(size_t c : index_) levels[c] = corrections_[c].invert(levels[c]);
+  return levels;
+}
+
+std::vector<uint16_t> ColorMixer::solve(double x, double y, double intensity) const {
+  std::vector<uint16_t> levels(channels_.size(), 0);
+  const std::vector<size_t> &index = index_;
+  double scale = 0;
+  for(size_t c : index) scale = std::max(scale, channels_[c][1]);
+  if(index.empty() || y <= 0) return levels;
+
+  // Target of luminance 1, against channels of luminance at most 1
+  const XYZ target{x / y, 1, (1 - x - y) / y};
+  const size_t n = index.size();
+  Matrix g(n, Vector(n, 0));
+  Vector h(n, 0);
+  for(size_t a = 0; a < n; ++a) {
+    const XYZ &ca = channels_[index[a]];
+    for(size_t b = 0; b < n; ++b) {
+      const XYZ &cb = channels_[index[b]];
+      for(size_t k = 0; k < 3; ++k) g[a][b] += ca[k] * cb[k] / (scale * scale);
+    }
+    g[a][a] += REGULARIZATION;
+    for(size_t k = 0; k < 3; ++k) h[a] += ca[k] / scale * target[k];
+  }
+  Vector weights = nnls(g, h);
+
+  // The brightest mix has its strongest channel at full power
+  double strongest = *std::max_element(weights.begin(), weights.end());
+  if(strongest <= 0) return levels;
+  intensity = clamp(intensity, 0, 1);
+  for(size_t a = 0; a < n; ++a) {
+    levels[index[a]] = std::lround(weights[a] / strongest * intensity * UINT16_MAX);
+  }
+  return levels;
+}
+
+void ColorMixer::buildTable() {
+  const size_t n = index_.size();
+  table_.resize(TABLE_SIZE * TABLE_SIZE * n);
+  for(size_t j = 0; j < TABLE_SIZE; ++j) {
+    double y = std::max(TABLE_Y * j / (TABLE_SIZE - 1), TABLE_Y_MIN);
+    for(size_t i = 0; i < TABLE_SIZE; ++i) {
+      auto levels = solve(TABLE_X * i / (TABLE_SIZE - 1), y, 1);
+      for(size_t c = 0; c < n; ++c) {
+        table_[(j * TABLE_SIZE + i) * n + c] = levels[index_[c]];
+      }
+    }
+  }
+}
+
+void ColorMixer::loadTable(const std::string &path) {
+  if(index_.empty()) return;
+  const size_t entries = TABLE_SIZE * TABLE_SIZE * index_.size();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd >= 0) {
+    try {
+      capnp::StreamFdMessageReader reader{kj::AutoCloseFd(fd)};
+      auto table = reader.getRoot<proto::ColorTable>();
+      auto levels = table.getLevels();
+      if(table.getSpectraHash() == hash_ && table.getSize() == TABLE_SIZE && levels.size() == entries) {
+        table_.assign(levels.begin(), levels.end());
+        return;
+      }
+    } catch(kj::Exception & e) {
+      fprintf(stderr, "ignoring color table %s: %s\n", path.c_str(), e.getDescription().cStr());
+    }
+  }
+
+  buildTable();
+
+  capnp::MallocMessageBuilder builder;
+  auto table = builder.initRoot<proto::ColorTable>();
+  table.setSpectraHash(hash_);
+  table.setSize(TABLE_SIZE);
+  auto levels = table.initLevels(entries);
+  for(size_t i = 0; i < entries; ++i) levels.set(i, table_[i]);
+
+  // Only a cache, so a crash at worst leaves a table to compute again
+  std::string tmp_path = path + ".tmp";
+  int out = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out < 0) {
+    fprintf(stderr, "failed to write color table %s: %s\n", tmp_path.c_str(), strerror(errno));
+    return;
+  }
+  try {
+    capnp::writeMessageToFd(out, builder);
+  } catch(kj::Exception & e) {
+    fprintf(stderr, "failed to write color table %s: %s\n", tmp_path.c_str(), e.getDescription().cStr());
+    ::close(out);
+    return;
+  }
+  ::close(out);
+  if(rename(tmp_path.c_str(), path.c_str()) < 0) {
+    fprintf(stderr, "failed to rename color table to %s: %s\n", path.c_str(), strerror(errno));
+  }
+}
+
+std::vector<uint16_t> ColorMixer::lookup(double x, double y, double intensity) const {
+  if(table_.empty()) return mix(x, y, intensity);
+
+  std::vector<uint16_t> levels(channels_.size(), 0);
+  const size_t n = index_.size();
+  double fx = clamp(x / TABLE_X, 0, 1) * (TABLE_SIZE - 1);
+  double fy = clamp(y / TABLE_Y, 0, 1) * (TABLE_SIZE - 1);
+  size_t x0 = std::min(static_cast<size_t>(fx), TABLE_SIZE - 2);
+  size_t y0 = std::min(static_cast<size_t>(fy), TABLE_SIZE - 2);
+  double tx = fx - x0, ty = fy - y0;
+  intensity = clamp(intensity, 0, 1);
+
+  const uint16_t *row0 = &table_[(y0 * TABLE_SIZE + x0) * n];
+  const uint16_t *row1 = row0 + TABLE_SIZE * n;
+  for(size_t c = 0; c < n; ++c) {
+    double power = (1 - ty) * ((1 - tx) * row0[c] + tx * row0[n + c]) +
+                   ty * ((1 - tx) * row1[c] + tx * row1[n + c]);
+    levels[index_[c]] = corrections_[index_[c]].invert(std::lround(power * intensity));
+  }
+  return levels;
+}
+
+void ColorMixer::measure(const std::vector<uint16_t> &levels, double *x, double *y, double *intensity) const {
+  XYZ sum{};
+  for(size_t c : index_) {
+    uint16_t power = corrections_[c](levels[c]);
+    for(size_t k = 0; k < 3; ++k) sum[k] += power * channels_[c][k];
+  }
+  double total = sum[0] + sum[1] + sum[2];
+  if(total <= 0) {
+    *x = *y = *intensity = 0;
+    return;
+  }
+  *x = sum[0] / total;
+  *y = sum[1] / total;
+
+  double brightest = 0;
+  auto full = lookup(*x, *y, 1);
+  for(size_t c : index_) brightest += corrections_[c](full[c]) * channels_[c][1];
+  *intensity = brightest > 0 ? clamp(sum[1] / brightest, 0, 1) : 0;
+}
+
+void ColorMixer::planckian(double kelvin, double *x, double *y) {
+  // Kim et al.'s cubic spline fit
+  double t = clamp(kelvin, 1667, 25000);
+  double t2 = t * t, t3 = t2 * t;
+  double xc = t <= 4000
+    ? -0.2661239e9 / t3 - 0.2343589e6 / t2 + 0.8776956e3 / t + 0.179910
+    : -3.0258469e9 / t3 + 2.1070379e6 / t2 + 0.2226347e3 / t + 0.240390;
+  double xc2 = xc * xc, xc3 = xc2 * xc;
+  double yc;
+  if(t <= 2222) {
+    yc = -1.1063814 * xc3 - 1.34811020 * xc2 + 2.18555832 * xc - 0.20219683;
+  } else if(t <= 4000) {
+    yc = -0.9549476 * xc3 - 1.37418593 * xc2 + 2.09137015 * xc - 0.16748867;
+  } else {
+    yc = 3.0817580 * xc3 - 5.87338670 * xc2 + 3.75112997 * xc - 0.37001483;
+  }
+  *x = xc;
+  *y = yc;
+}
+
+}
@@ -0,0 +1,74 @@
+#ifndef LEDPI_COLOR_MIXER_H
+#define LEDPI_COLOR_MIXER_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Correction.h"
+#include "common.capnp.h"
+
+namespace ledpi {
+
+// Solves for channel levels that mix a color, from the channels' spectra.
+// Each channel's CIE 1931 XYZ at full power is worked out once up front, so a
+// request is a non-negative least squares fit over that small matrix. With
+// more channels than the three tristimulus values, a light penalty on the
+// levels spreads the mix over the channels that give the most light. The
+// solve is in power, which each channel's correction then turns into a level.
+//
+// For fades, which need a mix every frame, the brightest mix of each color on
+// a grid of chromaticities is solved in advance, and lookups interpolate it
+// bilinearly and scale it by the intensity; mixes are linear in intensity, so
+// that is exact along the third axis. The grid is cached in a file beside the
+// state and recomputed when the spectra change.
+class ColorMixer {
+public:
+  // Spectra buckets, 5 nm wide from 400 nm
+  static constexpr size_t BUCKETS = 60;
+  // Grid points along x and y
+  static constexpr size_t TABLE_SIZE = 64;
+
+private:
+  typedef std::array<double, 3> XYZ;
+
+  std::vector<XYZ> channels_;  // all zero for channels without spectra
+  std::vector<Correction> corrections_;
+  std::vector<size_t> index_;  // of the mixable channels
+  uint64_t hash_;  // of the spectra and grid
+  std::vector<uint16_t> table_;  // power by y, x, then mixable channel
+
+  // Power of the mixable channels, indexed by channel
+  std::vector<uint16_t> solve(double x, double y, double intensity) const;
+  void buildTable();
+
+public:
+  explicit ColorMixer(capnp::List<Channel>::Reader channels);
+
+  // Channels with spectra; the others are left alone
+  bool mixable(size_t channel) const { return channel < channels_.size() && channels_[channel][1] > 0; }
+  size_t mixableCount() const { return index_.size(); }
+
+  // Levels of the mixable channels for CIE 1931 chromaticity x, y at
+  // intensity 0-1 of the brightest the channels mix it at. Colors outside the
+  // channels' gamut come out as the nearest they can mix.
+  std::vector<uint16_t> mix(double x, double y, double intensity) const;
+
+  // Read the grid from path, or compute it and write it there
+  void loadTable(const std::string &path);
+
+  // As mix, from the grid
+  std::vector<uint16_t> lookup(double x, double y, double intensity) const;
+
+  // Chromaticity and intensity the mixable channels make at levels. Off
+  // comes out as intensity 0 at x = y = 0.
+  void measure(const std::vector<uint16_t> &levels, double *x, double *y, double *intensity) const;
+
+  // Chromaticity of the Planckian radiator at temperature kelvin, 1667-25000
+  static void planckian(double kelvin, double *x, double *y);
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#include "Correction.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace ledpi {
+
+constexpr size_t Correction::POINTS;
+
+Correction::Correction() {
+  for(size_t i = 0; i < POINTS; ++i) table_[i] = i * UINT16_MAX / (POINTS - 1);
+}
+
+Correction::Correction(Channel::Reader channel) : Correction() {
+  auto curve = channel.getCurve();
+  float gamma = channel.getGamma();
+  if(curve.size() >= 2) {
+    for(size_t i = 0; i < POINTS; ++i) {
+      double position = static_cast<double>(i) * (curve.size() - 1) / (POINTS - 1);
+      size_t j = std::min(static_cast<size_t>(position), static_cast<size_t>(curve.size() - 2));
+      double t = position - j;
+      table_[i] = std::lround(curve[j] + t * (static_cast<double>(curve[j + 1]) - curve[j]));
+    }
+    linear_ = false;
+  } else if(curve.size() == 1) {
+    fprintf(stderr, "channel %s: a curve needs at least two points, ignoring it\n", channel.getName().cStr());
+  } else if(gamma > 0 && gamma != 1) {
+    for(size_t i = 0; i < POINTS; ++i) {
+      table_[i] = std::lround(std::pow(static_cast<double>(i) / (POINTS - 1), gamma) * UINT16_MAX);
+    }
+    linear_ = false;
+  }
+
+  // Inverting needs power to never fall as the level rises
+  for(size_t i = 1; i < POINTS; ++i) {
+    if(table_[i] < table_[i - 1]) {
+      fprintf(stderr, "channel %s: curve falls at point %zu, flattening it\n", channel.getName().cStr(), i);
+      table_[i] = table_[i - 1];
+    }
+  }
+}
+
+uint16_t Correction::invert(uint16_t power) const {
+  if(linear_) return power;
+  if(power <= table_[0]) return 0;
+  if(power > table_[POINTS - 1]) return UINT16_MAX;
+  // First point at or above power; the level is on the segment leading to it
+  size_t i = std::lower_bound(table_.begin(), table_.end(), power) - table_.begin();
+  uint32_t low = table_[i - 1], high = table_[i];
+  uint32_t position = (i - 1) * UINT16_MAX + ((power - low) * UINT16_MAX + high - low - 1) / (high - low);
+  return std::min<uint32_t>((position + POINTS - 2) / (POINTS - 1), UINT16_MAX);
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef LEDPI_CORRECTION_H
+#define LEDPI_CORRECTION_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.capnp.h"
+
+namespace ledpi {
+
+// Maps a channel's level to the power to drive it at, following the channel's
+// gamma exponent or sampled curve. The curve is compiled once into a table of
+// evenly spaced points, between which lookups interpolate with integer math.
+class Correction {
+public:
+  static constexpr size_t POINTS = 257;
+
+private:
+  std::array<uint16_t, POINTS> table_;  // power at level i * UINT16_MAX / (POINTS - 1)
+  bool linear_ = true;
+
+public:
+  // Linear
+  Correction();
+  explicit Correction(Channel::Reader channel);
+
+  bool linear() const { return linear_; }
+
+  uint16_t operator()(uint16_t level) const {
+    if(linear_) return level;
+    uint32_t position = static_cast<uint32_t>(level) * (POINTS - 1);
+    uint32_t i = position / UINT16_MAX, fraction = position % UINT16_MAX;
+    if(i == POINTS - 1) return table_[i];
+    // The table never falls, and a full step times fraction fits 32 bits unsigned
+    return table_[i] + (static_cast<uint32_t>(table_[i + 1]) - table_[i]) * fraction / UINT16_MAX;
+  }
+
+  // Lowest level driven at power or more
+  uint16_t invert(uint16_t power) const;
+};
+
+}
+
+#endif
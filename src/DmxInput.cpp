@@ -0,0 +1,162 @@
+#include "DmxInput.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace common;
+
+namespace ledpi {
+
+namespace {
+// Both protocols' packets fit in well under this
+void static_buffer_alloc_cb(size_t, uv_buf_t *buf) {
+  constexpr size_t length = 1500;
+  static char buffer[length];
+  buf->base = buffer;
+  buf->len = length;
+}
+
+// E1.31 data packet layout
+constexpr uint8_t SACN_IDENTIFIER[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+constexpr size_t SACN_IDENTIFIER_OFFSET = 4;
+constexpr size_t SACN_ROOT_VECTOR = 18;
+constexpr size_t SACN_CID = 22;
+constexpr size_t SACN_FRAMING_VECTOR = 40;
+constexpr size_t SACN_PRIORITY = 108;
+constexpr size_t SACN_SEQUENCE = 111;
+constexpr size_t SACN_OPTIONS = 112;
+constexpr size_t SACN_UNIVERSE = 113;
+constexpr size_t SACN_DMP_VECTOR = 117;
+constexpr size_t SACN_COUNT = 123;
+constexpr size_t SACN_START_CODE = 125;
+constexpr uint32_t VECTOR_ROOT_E131_DATA = 4;
+constexpr uint32_t VECTOR_E131_DATA_PACKET = 2;
+constexpr uint8_t VECTOR_DMP_SET_PROPERTY = 2;
+constexpr uint8_t OPTION_PREVIEW = 0x80;
+constexpr uint8_t OPTION_TERMINATED = 0x40;
+// A source not heard from for this long gives way to lower priorities
+constexpr std::chrono::milliseconds SACN_SOURCE_TIMEOUT(2500);
+
+// ArtDmx layout
+constexpr uint8_t ARTNET_IDENTIFIER[8] = {'A', 'r', 't', '-', 'N', 'e', 't', 0};
+constexpr size_t ARTNET_OPCODE = 8;
+constexpr size_t ARTNET_SUBUNI = 14;
+constexpr size_t ARTNET_NET = 15;
+constexpr size_t ARTNET_LENGTH = 16;
+constexpr size_t ARTNET_DATA = 18;
+constexpr uint16_t OP_DMX = 0x5000;
+
+constexpr size_t DMX_SLOTS = 512;
+
+uint16_t be16(const uint8_t *p) { return p[0] << 8 | p[1]; }
+uint32_t be32(const uint8_t *p) { return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+void bindAny(uv::UDP &udp, uint16_t port, const char *protocol) {
+  struct sockaddr_in addr;
+  uv_ip4_addr("0.0.0.0", port, &addr);
+  int result = udp.bind(reinterpret_cast<struct sockaddr *>(&addr), UV_UDP_REUSEADDR);
+  if(result < 0) {
+    fprintf(stderr, "failed to listen for %s on port %u: %s\n", protocol, port, uv_strerror(result));
+  }
+}
+}
+
+constexpr uint16_t DmxInput::SACN_PORT;
+constexpr uint16_t DmxInput::ARTNET_PORT;
+
+DmxInput::DmxInput(uv::Loop &loop, proto::DmxPatch::Reader patch, FrameFunc frame)
+    : loop_(loop), sacn_(loop), artnet_(loop), sacn_universe_(patch.getSacnUniverse()),
+      artnet_enabled_(patch.getArtnet()), artnet_port_address_(patch.getArtnetPortAddress()),
+      frame_(std::move(frame)) {
+  if(sacn_universe_ != 0) {
+    bindAny(sacn_, SACN_PORT, "sACN");
+    char group[16];
+    snprintf(group, sizeof(group), "239.255.%u.%u", sacn_universe_ >> 8, sacn_universe_ & 0xff);
+    int result = sacn_.set_membership(group, nullptr, UV_JOIN_GROUP);
+    if(result < 0) {
+      fprintf(stderr, "failed to join sACN group %s: %s\n", group, uv_strerror(result));
+    }
+    sacn_.recvStart(static_buffer_alloc_cb, [this](ssize_t result, const uv_buf_t *buf, const struct sockaddr *addr, unsigned) {
+        if(result < 0) {
+          fprintf(stderr, "sACN read error: %s\n", uv_strerror(result));
+          return;
+        }
+        if(addr == nullptr) return;
+        sacn(reinterpret_cast<const uint8_t *>(buf->base), result);
+      });
+  }
+
+  if(artnet_enabled_) {
+    bindAny(artnet_, ARTNET_PORT, "Art-Net");
+    artnet_.recvStart(static_buffer_alloc_cb, [this](ssize_t result, const uv_buf_t *buf, const struct sockaddr *addr, unsigned) {
+        if(result < 0) {
+          fprintf(stderr, "Art-Net read error: %s\n", uv_strerror(result));
+          return;
+        }
+        if(addr == nullptr) return;
+        artnet(reinterpret_cast<const uint8_t *>(buf->base), result);
+      });
+  }
+}
+
+void DmxInput::close() {
+  sacn_.close();
+  artnet_.close();
+}
+
+void DmxInput::sacn(const uint8_t *data, size_t size) {
+  if(size <= SACN_START_CODE) return;
+  if(memcmp(data + SACN_IDENTIFIER_OFFSET, SACN_IDENTIFIER, sizeof(SACN_IDENTIFIER)) != 0) return;
+  if(be32(data + SACN_ROOT_VECTOR) != VECTOR_ROOT_E131_DATA) return;
+  if(be32(data + SACN_FRAMING_VECTOR) != VECTOR_E131_DATA_PACKET) return;
+  if(data[SACN_DMP_VECTOR] != VECTOR_DMP_SET_PROPERTY) return;
+  if(be16(data + SACN_UNIVERSE) != sacn_universe_) return;
+  if(data[SACN_OPTIONS] & OPTION_PREVIEW) return;
+  if(data[SACN_START_CODE] != 0) return;  // not dimmer levels
+
+  // Other sources are ignored until the one followed goes quiet, unless
+  // they're of higher priority; a backup at the same priority waits
+  auto now = loop_.now();
+  uint8_t priority = data[SACN_PRIORITY];
+  bool followed = std::equal(source_.begin(), source_.end(), data + SACN_CID);
+  bool quiet = now - source_heard_ >= SACN_SOURCE_TIMEOUT;
+  if(!followed) {
+    if(!quiet && priority <= priority_) return;
+    std::copy(data + SACN_CID, data + SACN_CID + source_.size(), source_.begin());
+    sequenced_ = false;
+  }
+  if(data[SACN_OPTIONS] & OPTION_TERMINATED) {
+    // Gone for good, so let the others in now rather than after the timeout
+    source_heard_ = {};
+    return;
+  }
+  priority_ = priority;
+  source_heard_ = now;
+
+  // Drop packets overtaken by newer ones from the source, as E1.31 6.7.2 has it
+  uint8_t sequence = data[SACN_SEQUENCE];
+  int8_t ahead = static_cast<int8_t>(sequence - sequence_);
+  if(sequenced_ && ahead <= 0 && ahead > -20) return;
+  sequenced_ = true;
+  sequence_ = sequence;
+
+  size_t count = be16(data + SACN_COUNT);
+  if(count < 1) return;
+  count = std::min({count - 1, size - SACN_START_CODE - 1, DMX_SLOTS});
+  frame_(data + SACN_START_CODE + 1, count);
+}
+
+void DmxInput::artnet(const uint8_t *data, size_t size) {
+  if(size < ARTNET_DATA) return;
+  if(memcmp(data, ARTNET_IDENTIFIER, sizeof(ARTNET_IDENTIFIER)) != 0) return;
+  if((data[ARTNET_OPCODE] | data[ARTNET_OPCODE + 1] << 8) != OP_DMX) return;
+  uint16_t port_address = (data[ARTNET_NET] & 0x7f) << 8 | data[ARTNET_SUBUNI];
+  if(port_address != artnet_port_address_) return;
+
+  size_t count = std::min({static_cast<size_t>(be16(data + ARTNET_LENGTH)), size - ARTNET_DATA, DMX_SLOTS});
+  frame_(data + ARTNET_DATA, count);
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef LEDPI_DMX_INPUT_H
+#define LEDPI_DMX_INPUT_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include "Uv.h"
+#include "state.capnp.h"
+
+namespace ledpi {
+
+// Receives the DMX512 frames of one universe over E1.31 (sACN) and Art-Net on
+// the daemon's loop. sACN comes in on the universe's multicast group or by
+// unicast; of several sources, the highest priority one heard within the last
+// few seconds wins, and at equal priority the one followed keeps the universe
+// until it goes quiet. Art-Net ArtDmx comes broadcast or unicast. Frames arrive
+// as they are received, so several a loop iteration may be coalesced by the
+// caller.
+class DmxInput {
+public:
+  // Slots of a frame from slot 1 on
+  typedef std::function<void(const uint8_t *slots, size_t count)> FrameFunc;
+
+  static constexpr uint16_t SACN_PORT = 5568;
+  static constexpr uint16_t ARTNET_PORT = 6454;
+
+private:
+  common::uv::Loop &loop_;
+  common::uv::UDP sacn_;
+  common::uv::UDP artnet_;
+  uint16_t sacn_universe_;
+  bool artnet_enabled_;
+  uint16_t artnet_port_address_;
+  FrameFunc frame_;
+
+  // The sACN source followed, by its CID, and its sequence
+  std::array<uint8_t, 16> source_{};
+  uint8_t priority_ = 0;
+  common::uv::Clock::time_point source_heard_{};
+  bool sequenced_ = false;
+  uint8_t sequence_ = 0;
+
+  void sacn(const uint8_t *data, size_t size);
+  void artnet(const uint8_t *data, size_t size);
+
+public:
+  DmxInput(common::uv::Loop &loop, proto::DmxPatch::Reader patch, FrameFunc frame);
+
+  void close();
+};
+
+}
+
+#endif
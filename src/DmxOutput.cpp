@@ -0,0 +1,112 @@
+#include "DmxOutput.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "pigpio.h"
+
+using namespace common;
+
+namespace ledpi {
+
+constexpr unsigned DmxOutput::BAUD;
+constexpr unsigned DmxOutput::BREAK_MICROS;
+constexpr unsigned DmxOutput::MARK_MICROS;
+constexpr size_t DmxOutput::SLOTS;
+
+DmxOutput::DmxOutput(uv::Loop &loop, std::chrono::microseconds span)
+    : loop_(loop), timer_(loop), span_(span) {}
+
+void DmxOutput::setup(proto::State::Builder state) {
+  auto config = state.getDmxOutput();
+  device_ = config.getDevice().cStr();
+  corrections_.clear();
+  patches_.clear();
+  length_ = 1;
+  for(auto channel : state.getChannels()) {
+    corrections_.emplace_back(channel);
+    Patch patch{channel.getDmxSlot(), channel.getDmxFine()};
+    size_t last = patch.slot + patch.fine;
+    if(last > SLOTS) {
+      fprintf(stderr, "DMX slot %zu of %s is past the universe\n", last, channel.getName().cStr());
+      patch.slot = 0;
+    }
+    patches_.push_back(patch);
+    if(patch.slot != 0) length_ = std::max(length_, last + 1);
+  }
+  ramps_.assign(corrections_.size(), Ramp());
+
+  handle_ = serOpen(&device_[0], BAUD, PI_SER_TWO_STOP_BITS);
+  if(handle_ < 0) {
+    fprintf(stderr, "DMX output on %s unavailable: %d\n", device_.c_str(), handle_);
+    return;
+  }
+  // Sending takes the break, the mark and 11 bits a slot; any sooner and
+  // serBreak's drain would hold up the loop every frame
+  size_t sending = BREAK_MICROS + MARK_MICROS + (length_ * 11 * 1000000 + BAUD - 1) / BAUD;
+  std::chrono::milliseconds shortest((sending + 999) / 1000);
+  std::chrono::milliseconds period(config.getPeriod());
+  if(period < shortest) {
+    fprintf(stderr, "DMX period of %u ms is shorter than a frame takes, using %lld\n", config.getPeriod(),
+            static_cast<long long>(shortest.count()));
+    period = shortest;
+  }
+  printf("DMX on %s: %zu slots every %lld ms\n", device_.c_str(), length_ - 1,
+         static_cast<long long>(period.count()));
+  timer_.start([this]() { send(); }, period, period);
+}
+
+void DmxOutput::put(size_t channel, uint16_t power) {
+  auto &patch = patches_[channel];
+  if(patch.fine) {
+    frame_[patch.slot] = power >> 8;
+    frame_[patch.slot + 1] = power & 0xff;
+  } else {
+    frame_[patch.slot] = (power + 0x80) / 0x101;
+  }
+}
+
+void DmxOutput::apply(proto::State::Reader state, const ChannelMask &changed) {
+  auto levels = state.getLevels();
+  for(size_t i = 0; i < levels.size(); ++i) {
+    if(i < changed.size() && !changed[i]) continue;
+    if(patches_[i].slot == 0) continue;
+    ramps_[i].active = false;
+    put(i, corrections_[i](levels[i]));
+  }
+}
+
+void DmxOutput::ramp(proto::State::Reader, size_t channel, uint16_t from, uint16_t to) {
+  if(patches_[channel].slot == 0) return;
+  auto &ramp = ramps_[channel];
+  ramp.active = true;
+  ramp.from = corrections_[channel](from);
+  ramp.to = corrections_[channel](to);
+  ramp.start = loop_.now();
+}
+
+void DmxOutput::send() {
+  // Channels handed to ramp only hear from the fader again a tick later
+  auto now = loop_.now();
+  for(size_t i = 0; i < ramps_.size(); ++i) {
+    auto &ramp = ramps_[i];
+    if(!ramp.active) continue;
+    auto elapsed = std::min(std::chrono::duration_cast<std::chrono::microseconds>(now - ramp.start), span_);
+    int32_t power = ramp.from + (static_cast<int32_t>(ramp.to) - ramp.from) * elapsed.count() / span_.count();
+    put(i, power);
+  }
+
+  if(serBreak(handle_, BREAK_MICROS, MARK_MICROS) < 0 || serWrite(handle_, frame_.data(), length_) < 0) {
+    fprintf(stderr, "DMX write to %s failed\n", device_.c_str());
+  }
+}
+
+void DmxOutput::close() {
+  timer_.close();
+  if(handle_ < 0) return;
+  send();
+  serClose(handle_);
+  handle_ = -1;
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef LEDPI_DMX_OUTPUT_H
+#define LEDPI_DMX_OUTPUT_H
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Correction.h"
+#include "Output.h"
+#include "Uv.h"
+
+namespace ledpi {
+
+// DMX512 down a UART to the channels with a dmxSlot, at each one's corrected
+// power. Receivers expect the universe over and over, so apply only updates
+// the frame and a timer sends it, after a break, every period.
+class DmxOutput : public Output {
+public:
+  static constexpr unsigned BAUD = 250000;
+  static constexpr unsigned BREAK_MICROS = 100;
+  static constexpr unsigned MARK_MICROS = 12;
+  static constexpr size_t SLOTS = 512;
+
+private:
+  // Where a channel handed to ramp is on its way, as the frame goes out
+  // between the fader's ticks
+  struct Patch {
+    size_t slot;  // 0 for none
+    bool fine;
+  };
+
+  struct Ramp {
+    bool active = false;
+    uint16_t from, to;
+    common::uv::Clock::time_point start;
+  };
+
+  common::uv::Loop &loop_;
+  common::uv::Timer timer_;
+  std::chrono::microseconds span_;
+  std::string device_;
+  int handle_ = -1;
+  std::vector<Correction> corrections_;
+  std::vector<Patch> patches_;
+  std::vector<Ramp> ramps_;
+  std::array<char, SLOTS + 1> frame_{};  // start code 0, then the slots
+  size_t length_ = 1;  // through the highest slot patched
+
+  void put(size_t channel, uint16_t power);
+  void send();
+
+public:
+  // Ramps take span, which the fader's must match
+  DmxOutput(common::uv::Loop &loop, std::chrono::microseconds span);
+
+  void setup(proto::State::Builder state) override;
+  void apply(proto::State::Reader state, const ChannelMask &changed) override;
+  void ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) override;
+
+  // Sends the frame once more, so a last apply goes out, and stops
+  void close();
+};
+
+}
+
+#endif
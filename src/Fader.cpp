@@ -0,0 +1,70 @@
+#include "Fader.h"
+
+using namespace common;
+
+namespace ledpi {
+
+float ease(Easing easing, float t) {
+  switch(easing) {
+  case Easing::LINEAR: return t;
+  case Easing::EASE_IN: return t * t;
+  case Easing::EASE_OUT: return 1 - (1 - t) * (1 - t);
+  case Easing::EASE_IN_OUT: return t * t * (3 - 2 * t);
+  }
+  return t;
+}
+
+Fader::Fader(uv::Loop &loop, std::chrono::milliseconds period, SetFunc set, FlushFunc flush)
+    : loop_(loop), timer_(loop), period_(period), set_(std::move(set)), flush_(std::move(flush)) {}
+
+void Fader::start(size_t channel, uint16_t from, uint16_t to, std::chrono::milliseconds duration, Easing easing) {
+  if(channel >= fades_.size()) fades_.resize(channel + 1);
+  auto &fade = fades_[channel];
+  if(!fade.active) {
+    fade.active = true;
+    if(active_++ == 0) timer_.start([this]() { tick(); }, period_, period_);
+  }
+  fade.from = from;
+  fade.to = to;
+  fade.start = loop_.now();
+  fade.duration = std::chrono::duration_cast<uv::Clock::duration>(duration);
+  fade.easing = easing;
+}
+
+void Fader::cancel(size_t channel) {
+  if(!active(channel)) return;
+  fades_[channel].active = false;
+  if(--active_ == 0) timer_.stop();
+}
+
+uint16_t Fader::level(const Fade &fade, uv::Clock::duration elapsed) {
+  if(elapsed >= fade.duration) return fade.to;
+  float t = ease(fade.easing, static_cast<float>(elapsed.count()) / fade.duration.count());
+  return fade.from + t * (static_cast<int32_t>(fade.to) - fade.from);
+}
+
+void Fader::tick() {
+  auto now = loop_.now();
+  ChannelMask changed(fades_.size());
+  for(size_t i = 0; i < fades_.size(); ++i) {
+    auto &fade = fades_[i];
+    if(!fade.active) continue;
+
+    auto elapsed = now - fade.start;
+    uint16_t current = level(fade, elapsed);
+    set_(i, current);
+    if(elapsed >= fade.duration) {
+      fade.active = false;
+      --active_;
+    } else if(ramp_) {
+      ramp_(i, current, level(fade, elapsed + span_));
+      continue;
+    }
+    changed[i] = true;
+  }
+
+  if(active_ == 0) timer_.stop();
+  flush_(changed);
+}
+
+}
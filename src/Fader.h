@@ -0,0 +1,73 @@
+#ifndef LEDPI_FADER_H
+#define LEDPI_FADER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "Output.h"
+#include "Uv.h"
+
+namespace ledpi {
+
+enum class Easing { LINEAR, EASE_IN, EASE_OUT, EASE_IN_OUT };
+
+// Progress 0-1 along an eased fade at time t, 0-1, through it
+float ease(Easing easing, float t);
+
+// Interpolates channel levels over time. A timer ticks only while at least one
+// fade is in progress, and each tick touches only the fading channels.
+//
+// With a ramp function set, each tick instead hands over where every fading
+// channel should be one span later, for outputs that can get there by
+// themselves; the tick period must then be shorter than the span.
+class Fader {
+public:
+  typedef std::function<void(size_t channel, uint16_t level)> SetFunc;
+  typedef std::function<void(const ChannelMask &changed)> FlushFunc;
+  typedef std::function<void(size_t channel, uint16_t from, uint16_t to)> RampFunc;
+
+private:
+  struct Fade {
+    bool active = false;
+    uint16_t from, to;
+    common::uv::Clock::time_point start;
+    common::uv::Clock::duration duration;
+    Easing easing;
+  };
+
+  common::uv::Loop &loop_;
+  common::uv::Timer timer_;
+  std::chrono::milliseconds period_;
+  SetFunc set_;
+  FlushFunc flush_;
+  RampFunc ramp_;
+  common::uv::Clock::duration span_{};
+  std::vector<Fade> fades_;
+  size_t active_ = 0;
+
+  static uint16_t level(const Fade &fade, common::uv::Clock::duration elapsed);
+  void tick();
+
+public:
+  Fader(common::uv::Loop &loop, std::chrono::milliseconds period, SetFunc set, FlushFunc flush);
+
+  void start(size_t channel, uint16_t from, uint16_t to, std::chrono::milliseconds duration, Easing easing);
+  void cancel(size_t channel);
+  bool active(size_t channel) const { return channel < fades_.size() && fades_[channel].active; }
+  // Level an active fade ends at
+  uint16_t target(size_t channel) const { return fades_[channel].to; }
+
+  template<typename Rep, typename Period>
+  void setRamp(RampFunc ramp, std::chrono::duration<Rep, Period> span) {
+    ramp_ = std::move(ramp);
+    span_ = std::chrono::duration_cast<common::uv::Clock::duration>(span);
+  }
+
+  void close() { timer_.close(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef LEDPI_OUTPUT_H
+#define LEDPI_OUTPUT_H
+
+#include <memory>
+#include <vector>
+
+#include "state.capnp.h"
+
+namespace ledpi {
+
+// Flags indexed by channel
+typedef std::vector<bool> ChannelMask;
+
+// A destination for channel levels. Outputs are set up once after the state
+// is loaded, and may note what the hardware achieved in the channel configs,
+// then handed the whole state along with the channels whose levels changed.
+class Output {
+public:
+  virtual ~Output() {}
+
+  virtual void setup(proto::State::Builder state) = 0;
+  virtual void apply(proto::State::Reader state, const ChannelMask &changed) = 0;
+
+  // Move channel from its current level, `from`, towards `to` by itself. Outputs
+  // that can't just display `from`.
+  virtual void ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) {
+    (void)from; (void)to;
+    ChannelMask changed(channel + 1);
+    changed[channel] = true;
+    apply(state, changed);
+  }
+};
+
+typedef std::vector<std::unique_ptr<Output>> Outputs;
+
+}
+
+#endif
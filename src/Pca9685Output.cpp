@@ -0,0 +1,163 @@
+#include "Pca9685Output.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "pigpio.h"
+
+namespace ledpi {
+
+namespace {
+constexpr double OSCILLATOR_HZ = 25e6;
+constexpr uint8_t MODE1_AI = 0x20;  // auto-increment
+constexpr uint8_t MODE1_SLEEP = 0x10;
+constexpr uint8_t MODE2_OUTDRV = 0x04;  // totem pole; outputs change on stop
+constexpr uint8_t FULL = 0x10;  // in ON_H or OFF_H, ignore the counts
+constexpr unsigned COUNTS = 4096;
+}
+
+constexpr size_t Pca9685Output::OUTPUTS;
+constexpr uint8_t Pca9685Output::MODE1;
+constexpr uint8_t Pca9685Output::MODE2;
+constexpr uint8_t Pca9685Output::LED0_ON_L;
+constexpr uint8_t Pca9685Output::PRE_SCALE;
+constexpr size_t Pca9685Output::REGISTERS;
+constexpr size_t Pca9685Output::MERGE_GAP;
+
+void Pca9685Output::setup(proto::State::Builder state) {
+  auto config = state.getPca9685();
+  bus_ = config.getBus();
+  unsigned frequency = std::max<unsigned>(config.getFrequency(), 1);
+  uint8_t prescale = std::min(std::max(std::lround(OSCILLATOR_HZ / (COUNTS * frequency)) - 1, 3L), 255L);
+
+  boards_.clear();
+  for(auto address : config.getAddresses()) {
+    boards_.push_back(Board{address, {}, {}, false});
+  }
+
+  corrections_.clear();
+  outputs_.clear();
+  for(auto channel : state.getChannels()) {
+    corrections_.emplace_back(channel);
+    size_t output = channel.getPca9685Output();
+    if(output > boards_.size() * OUTPUTS) {
+      fprintf(stderr, "PCA9685 output %zu of %s is past the boards\n", output, channel.getName().cStr());
+      output = 0;
+    }
+    outputs_.push_back(output);
+  }
+  // Whatever the boards held, the first frame overwrites
+  for(size_t output = 0; output < boards_.size() * OUTPUTS; ++output) {
+    put(output, 0);
+  }
+
+  handle_ = i2cOpen(bus_, boards_.empty() ? 0 : boards_[0].address, 0);
+  if(handle_ < 0) {
+    fprintf(stderr, "PCA9685 output on I2C bus %u unavailable: %d\n", bus_, handle_);
+    return;
+  }
+
+  // The prescaler only takes while asleep
+  zip_.clear();
+  for(auto &board : boards_) {
+    zip_.insert(zip_.end(), {PI_I2C_ADDR, static_cast<char>(board.address)});
+    const uint8_t sleep[] = {MODE1_AI | MODE1_SLEEP};
+    write(MODE1, sleep, sizeof(sleep));
+    write(PRE_SCALE, &prescale, 1);
+    const uint8_t modes[] = {MODE1_AI, MODE2_OUTDRV};
+    write(MODE1, modes, sizeof(modes));
+  }
+  zip_.push_back(PI_I2C_END);
+  int result = i2cZip(handle_, zip_.data(), zip_.size(), nullptr, 0);
+  if(result < 0) {
+    fprintf(stderr, "PCA9685 setup on I2C bus %u failed: %d\n", bus_, result);
+  }
+  printf("PCA9685 on I2C bus %u: %zu boards at %.0f Hz\n", bus_, boards_.size(),
+         OSCILLATOR_HZ / (COUNTS * (prescale + 1)));
+}
+
+void Pca9685Output::put(size_t output, uint16_t power) {
+  auto &board = boards_[output / OUTPUTS];
+  uint8_t *led = &board.frame[4 * (output % OUTPUTS)];
+  // Each output turns on at its own phase, so the boards' load is spread over
+  // the period, and only the off count changes as it dims
+  unsigned on = (output % OUTPUTS) * (COUNTS / OUTPUTS);
+  unsigned counts = (static_cast<uint32_t>(power) * COUNTS + UINT16_MAX / 2) / UINT16_MAX;
+  unsigned off = (on + counts) % COUNTS;
+  led[0] = on & 0xff;
+  led[1] = (on >> 8) | (counts == COUNTS ? FULL : 0);
+  led[2] = off & 0xff;
+  led[3] = (off >> 8) | (counts == 0 ? FULL : 0);
+}
+
+void Pca9685Output::write(uint8_t reg, const uint8_t *data, size_t count) {
+  zip_.insert(zip_.end(), {PI_I2C_WRITE, static_cast<char>(count + 1), static_cast<char>(reg)});
+  zip_.insert(zip_.end(), data, data + count);
+}
+
+void Pca9685Output::diff(Board &board) {
+  auto changed = [&board](size_t i) { return !board.synced || board.frame[i] != board.sent[i]; };
+  bool addressed = false;
+  for(size_t i = 0; i < REGISTERS; ++i) {
+    if(!changed(i)) continue;
+    size_t end = i + 1;
+    for(size_t j = end; j < REGISTERS && j <= end + MERGE_GAP; ++j) {
+      if(changed(j)) end = j + 1;
+    }
+    if(!addressed) {
+      zip_.insert(zip_.end(), {PI_I2C_ADDR, static_cast<char>(board.address)});
+      addressed = true;
+    }
+    write(LED0_ON_L + i, &board.frame[i], end - i);
+    i = end - 1;
+  }
+}
+
+void Pca9685Output::apply(proto::State::Reader state, const ChannelMask &changed) {
+  ++applies_;
+  auto levels = state.getLevels();
+  for(size_t i = 0; i < levels.size(); ++i) {
+    if(i < changed.size() && !changed[i]) continue;
+    if(outputs_[i] == 0) continue;
+    put(outputs_[i] - 1, corrections_[i](levels[i]));
+  }
+  if(handle_ < 0) return;
+
+  zip_.clear();
+  for(auto &board : boards_) {
+    diff(board);
+  }
+  if(zip_.empty()) return;
+  zip_.push_back(PI_I2C_END);
+
+  // The boards update their outputs at the stop, so each board's changes
+  // land in the same period
+  int result = i2cZip(handle_, zip_.data(), zip_.size(), nullptr, 0);
+  for(auto &board : boards_) {
+    board.sent = board.frame;
+    board.synced = result >= 0;
+  }
+  if(result < 0) fprintf(stderr, "PCA9685 write on I2C bus %u failed: %d\n", bus_, result);
+}
+
+void Pca9685Output::ramp(proto::State::Reader, size_t channel, uint16_t from, uint16_t) {
+  // The fader flushes once it has handed out a tick's ramps, and `from` is
+  // written with the rest of that frame
+  if(outputs_[channel] == 0) return;
+  put(outputs_[channel] - 1, corrections_[channel](from));
+}
+
+std::vector<uint8_t> Pca9685Output::addresses() const {
+  std::vector<uint8_t> addresses;
+  for(auto &board : boards_) addresses.push_back(board.address);
+  return addresses;
+}
+
+void Pca9685Output::close() {
+  if(handle_ < 0) return;
+  i2cClose(handle_);
+  handle_ = -1;
+}
+
+}
@@ -0,0 +1,65 @@
+#ifndef LEDPI_PCA9685_OUTPUT_H
+#define LEDPI_PCA9685_OUTPUT_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "Correction.h"
+#include "Output.h"
+
+namespace ledpi {
+
+// PCA9685 boards on one I2C bus, driving the channels with a pca9685Output at
+// each one's corrected power in 12 bits. The bus is slow enough that the
+// bytes sent bound the frame rate, so each frame only writes the registers
+// that changed since the last, all the boards' in one transaction.
+class Pca9685Output : public Output {
+public:
+  static constexpr size_t OUTPUTS = 16;
+
+private:
+  static constexpr uint8_t MODE1 = 0x00;
+  static constexpr uint8_t MODE2 = 0x01;
+  static constexpr uint8_t LED0_ON_L = 0x06;
+  static constexpr uint8_t PRE_SCALE = 0xfe;
+  static constexpr size_t REGISTERS = 4 * OUTPUTS;  // ON_L, ON_H, OFF_L and OFF_H of each
+  // Another write costs a repeated start, the address and the register, so
+  // runs this close together are cheaper to write as one
+  static constexpr size_t MERGE_GAP = 2;
+
+  struct Board {
+    uint8_t address;
+    std::array<uint8_t, REGISTERS> frame;  // registers to write
+    std::array<uint8_t, REGISTERS> sent;   // as the board holds them
+    bool synced;  // sent is known
+  };
+
+  int handle_ = -1;
+  unsigned bus_ = 0;
+  std::vector<Board> boards_;
+  std::vector<Correction> corrections_;
+  std::vector<size_t> outputs_;  // by channel, counting from 1, 0 for none
+  std::vector<char> zip_;  // i2cZip commands for the frame
+  size_t applies_ = 0;
+
+  void put(size_t output, uint16_t power);  // counting from 0
+  void write(uint8_t reg, const uint8_t *data, size_t count);
+  void diff(Board &board);
+
+public:
+  void setup(proto::State::Builder state) override;
+  void apply(proto::State::Reader state, const ChannelMask &changed) override;
+  void ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) override;
+
+  void close();
+
+  unsigned bus() const { return bus_; }
+  std::vector<uint8_t> addresses() const;
+  // How many times apply was called, for checking the bus traffic against
+  size_t applies() const { return applies_; }
+};
+
+}
+
+#endif
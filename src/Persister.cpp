@@ -0,0 +1,258 @@
+#include "Persister.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <kj/io.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
+
+namespace ledpi {
+
+namespace {
+constexpr std::chrono::seconds RETRY_PERIOD(5);
+// Least time between snapshots while there's no journal to append to
+constexpr std::chrono::seconds SNAPSHOT_SPACING(30);
+
+class ByteStream : public kj::OutputStream {
+  std::vector<kj::byte> &bytes_;
+
+public:
+  explicit ByteStream(std::vector<kj::byte> &bytes) : bytes_(bytes) {}
+
+  void write(const void *buffer, size_t size) override {
+    auto bytes = static_cast<const kj::byte *>(buffer);
+    bytes_.insert(bytes_.end(), bytes, bytes + size);
+  }
+};
+
+}
+
+void Persister::apply(proto::JournalEntry::Reader entry, proto::State::Builder state) {
+  switch(entry.which()) {
+  case proto::JournalEntry::LEVELS: {
+    auto levels = state.getLevels();
+    for(auto level : entry.getLevels()) {
+      if(level.getChannel() < levels.size()) levels.set(level.getChannel(), level.getValue());
+    }
+    break;
+  }
+  case proto::JournalEntry::NAME:
+    state.setName(entry.getName());
+    break;
+  case proto::JournalEntry::ZONE:
+    state.setZone(entry.getZone());
+    break;
+  case proto::JournalEntry::SCENE: {
+    auto scene = entry.getScene();
+    auto scenes = state.getScenes();
+    for(size_t i = 0; i < scenes.size(); ++i) {
+      if(scenes.asReader()[i].getName() == scene.getName()) {
+        scenes.setWithCaveats(i, scene);
+        return;
+      }
+    }
+    // Grow the list by one. Cap'n Proto can't free within a message, so the
+    // old list and the scenes in it stay behind, orphaned, in the state's
+    // arena for as long as the process runs; snapshots are built afresh and
+    // don't carry them. That's accepted: a new scene name is a rare, manual
+    // act, and the state is reloaded compact at each start.
+    auto old = state.disownScenes();
+    auto grown = state.initScenes(old.getReader().size() + 1);
+    for(size_t i = 0; i < old.getReader().size(); ++i) {
+      grown.setWithCaveats(i, old.getReader()[i]);
+    }
+    grown.setWithCaveats(old.getReader().size(), scene);
+    break;
+  }
+  }
+}
+
+Persister::Persister(common::uv::Loop &loop, SnapshotFunc snapshot, std::string path, std::string tmp_path,
+                     std::string journal_path, size_t journal_limit)
+  : loop_(loop), retry_(loop), snapshot_(std::move(snapshot)), path_(std::move(path)), tmp_path_(std::move(tmp_path)),
+    journal_path_(std::move(journal_path)), journal_limit_(journal_limit) {
+  journal_ = ::open(journal_path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if(journal_ < 0) {
+    fprintf(stderr, "failed to open journal at %s: %s\n", journal_path_.c_str(), strerror(errno));
+    // Snapshots alone, spaced out, still keep the state file current
+    return;
+  }
+  struct stat st;
+  if(fstat(journal_, &st) == 0) journal_size_ = st.st_size;
+}
+
+Persister::~Persister() {
+  if(journal_ >= 0) ::close(journal_);
+}
+
+size_t Persister::replay(const std::string &journal_path, proto::State::Builder state) {
+  int fd = ::open(journal_path.c_str(), O_RDWR);
+  if(fd < 0) return 0;
+
+  struct stat st;
+  size_t count = 0;
+  off_t end = 0;
+  if(fstat(fd, &st) == 0) {
+    while(end < st.st_size) {
+      try {
+        capnp::StreamFdMessageReader reader(fd);
+        apply(reader.getRoot<proto::JournalEntry>(), state);
+      } catch(kj::Exception &e) {
+        fprintf(stderr, "dropping torn journal entry at %lld: %s\n",
+                static_cast<long long>(end), e.getDescription().cStr());
+        if(ftruncate(fd, end) < 0) {
+          fprintf(stderr, "failed to truncate journal: %s\n", strerror(errno));
+        }
+        break;
+      }
+      end = lseek(fd, 0, SEEK_CUR);
+      ++count;
+    }
+  }
+
+  ::close(fd);
+  return count;
+}
+
+void Persister::record(capnp::MessageBuilder &entry) {
+  if(closed_) return;
+  ByteStream stream(pending_);
+  capnp::writeMessage(stream, entry);
+  next();
+}
+
+void Persister::close() {
+  closed_ = true;
+  retry_.close();
+}
+
+void Persister::next() {
+  if(busy_ || closed_) return;
+  if(journal_ < 0) {
+    if(!pending_.empty()) compact();
+  } else if(compact_ || journal_size_ > journal_limit_) {
+    compact();
+  } else if(!pending_.empty()) {
+    append();
+  }
+}
+
+void Persister::append() {
+  busy_ = true;
+  writing_.clear();
+  writing_.swap(pending_);
+
+  uv_buf_t buf = uv_buf_init(reinterpret_cast<char *>(writing_.data()), writing_.size());
+  int res = fs_.write(loop_, journal_, &buf, 1, -1, [this](ssize_t result) {
+      if(result >= 0 && static_cast<size_t>(result) != writing_.size()) result = UV_EIO;
+      if(!check(result, "append to", journal_path_)) return;
+      journal_size_ += writing_.size();
+      int res = fs_.fsync(loop_, journal_, [this](ssize_t result) {
+          if(!check(result, "sync", journal_path_)) return;
+          finish();
+        });
+      check(res, "sync", journal_path_);
+    });
+  check(res, "append to", journal_path_);
+}
+
+void Persister::compact() {
+  busy_ = true;
+
+  // The snapshot covers every entry recorded so far, which are dropped once
+  // it's in place
+  covered_ = pending_.size();
+  capnp::MallocMessageBuilder snapshot;
+  snapshot_(snapshot);
+  writing_.clear();
+  ByteStream stream(writing_);
+  capnp::writePackedMessage(stream, snapshot);
+
+  int res = fs_.open(loop_, tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, [this](ssize_t result) {
+      if(!check(result, "open", tmp_path_)) return;
+      file_ = result;
+      uv_buf_t buf = uv_buf_init(reinterpret_cast<char *>(writing_.data()), writing_.size());
+      int res = fs_.write(loop_, file_, &buf, 1, 0, [this](ssize_t result) {
+          if(result >= 0 && static_cast<size_t>(result) != writing_.size()) result = UV_EIO;
+          if(!check(result, "write", tmp_path_)) return;
+          int res = fs_.fsync(loop_, file_, [this](ssize_t result) {
+              if(!check(result, "sync", tmp_path_)) return;
+              int res = fs_.close(loop_, file_, [this](ssize_t result) {
+                  file_ = -1;
+                  if(!check(result, "close", tmp_path_)) return;
+                  int res = fs_.rename(loop_, tmp_path_.c_str(), path_.c_str(), [this](ssize_t result) {
+                      if(!check(result, "rename", tmp_path_)) return;
+                      pending_.erase(pending_.begin(), pending_.begin() + covered_);
+                      if(journal_ < 0) {
+                        // Each change would otherwise cost a snapshot of its own
+                        if(!closed_) retry_.start([this]() { finish(); }, SNAPSHOT_SPACING);
+                        return;
+                      }
+                      // Until here, the journal's entries replay on top of either state file
+                      int res = fs_.ftruncate(loop_, journal_, 0, [this](ssize_t result) {
+                          if(!check(result, "truncate", journal_path_)) return;
+                          journal_size_ = 0;
+                          compact_ = false;
+                          finish();
+                        });
+                      check(res, "truncate", journal_path_);
+                    });
+                  check(res, "rename", tmp_path_);
+                });
+              check(res, "close", tmp_path_);
+            });
+          check(res, "sync", tmp_path_);
+        });
+      check(res, "write", tmp_path_);
+    });
+  check(res, "open", tmp_path_);
+}
+
+bool Persister::check(ssize_t result, const char *what, const std::string &path) {
+  if(result >= 0) return true;
+  fprintf(stderr, "failed to %s %s: %s\n", what, path.c_str(), uv_strerror(result));
+  if(file_ >= 0) {
+    ::close(file_);
+    file_ = -1;
+  }
+  // A failed append may have left part of an entry behind, and a failed
+  // snapshot still has to be taken, so start over with a fresh snapshot
+  compact_ = true;
+  if(!closed_) retry_.start([this]() { finish(); }, RETRY_PERIOD);
+  return false;
+}
+
+void Persister::finish() {
+  busy_ = false;
+  next();
+}
+
+bool Persister::save() {
+  int fd = ::open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "failed to open state file at %s: %s\n", tmp_path_.c_str(), strerror(errno));
+    return false;
+  }
+  capnp::MallocMessageBuilder snapshot;
+  snapshot_(snapshot);
+  capnp::writePackedMessageToFd(fd, snapshot);
+  fsync(fd);
+  ::close(fd);
+  if(rename(tmp_path_.c_str(), path_.c_str()) < 0) {
+    fprintf(stderr, "failed to store state file to %s: %s\n", path_.c_str(), strerror(errno));
+    return false;
+  }
+  pending_.clear();
+  if(journal_ >= 0 && ftruncate(journal_, 0) < 0) {
+    fprintf(stderr, "failed to truncate journal at %s: %s\n", journal_path_.c_str(), strerror(errno));
+  }
+  journal_size_ = 0;
+  return true;
+}
+
+}
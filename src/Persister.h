@@ -0,0 +1,81 @@
+#ifndef LEDPI_PERSISTER_H
+#define LEDPI_PERSISTER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <capnp/message.h>
+
+#include "Uv.h"
+#include "state.capnp.h"
+
+namespace ledpi {
+
+// Keeps the packed state file and the journal beside it up to date while the
+// daemon runs. Each applied change is recorded as a JournalEntry and appended
+// to the journal on the libuv thread pool; entries recorded while an append is
+// in flight go out together in the next one. Once the journal outgrows its
+// limit, a snapshot of the state is written to the temporary file, synced and
+// renamed over the state file, and the journal is truncated. Only one file
+// operation is in flight at a time, and after a failure a snapshot is retried
+// after a pause. Without a journal, snapshots alone are taken, no more often
+// than every half minute.
+class Persister {
+public:
+  // Fills a fresh message with the state as it should be restored
+  typedef std::function<void(capnp::MessageBuilder &snapshot)> SnapshotFunc;
+
+private:
+  common::uv::Loop &loop_;
+  common::uv::Timer retry_;
+  common::uv::Fs fs_;
+  SnapshotFunc snapshot_;
+  std::string path_;
+  std::string tmp_path_;
+  std::string journal_path_;
+  size_t journal_limit_;
+  uv_file journal_ = -1;
+  size_t journal_size_ = 0;
+  std::vector<kj::byte> pending_;  // entries not yet appended
+  std::vector<kj::byte> writing_;  // entries or snapshot being written
+  size_t covered_ = 0;  // bytes of pending_ the snapshot being written covers
+  uv_file file_ = -1;
+  bool busy_ = false;
+  bool compact_ = false;  // the journal can't be trusted to append to
+  bool closed_ = false;
+
+  void next();
+  void append();
+  void compact();
+  bool check(ssize_t result, const char *what, const std::string &path);
+  void finish();
+
+public:
+  Persister(common::uv::Loop &loop, SnapshotFunc snapshot, std::string path, std::string tmp_path,
+            std::string journal_path, size_t journal_limit);
+  ~Persister();
+
+  // Apply the journal's entries to a state loaded from the state file. A torn
+  // entry at the end, left by a power cut, is cut off. Returns the number of
+  // entries applied.
+  static size_t replay(const std::string &journal_path, proto::State::Builder state);
+
+  // Apply one entry as replay does
+  static void apply(proto::JournalEntry::Reader entry, proto::State::Builder state);
+
+  // Append a JournalEntry
+  void record(capnp::MessageBuilder &entry);
+
+  // Stop writing in the background. A write in progress still completes.
+  // Must be called before destruction.
+  void close();
+
+  // Write a snapshot out synchronously and empty the journal, for once the
+  // loop has stopped
+  bool save();
+};
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "PixelStrip.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "pigpio.h"
+
+using namespace common;
+
+namespace ledpi {
+
+constexpr std::chrono::milliseconds PixelStrip::RETRY;
+
+size_t PixelStrip::bytes(proto::Strip::Reader config) {
+  return config.getPixels() * (config.getWhite() ? 4 : 3);
+}
+
+PixelStrip::PixelStrip(uv::Loop &loop, proto::Strip::Reader config)
+    : retry_(loop), frame_(bytes(config)), pixel_size_(config.getWhite() ? 4 : 3) {
+  if(frame_.empty()) return;
+  int result = gpioStripOpen(config.getGpio());
+  if(result < 0) {
+    fprintf(stderr, "pixel strip on gpio %u unavailable: %d\n", config.getGpio(), result);
+    return;
+  }
+  open_ = true;
+  printf("pixel strip on gpio %u: %u pixels\n", config.getGpio(), config.getPixels());
+}
+
+size_t PixelStrip::set(size_t first, const uint8_t *pixels, size_t size) {
+  size_t count = size / pixel_size_;
+  size_t total = frame_.size() / pixel_size_;
+  if(first >= total) return 0;
+  count = std::min(count, total - first);
+  memcpy(&frame_[first * pixel_size_], pixels, count * pixel_size_);
+  dirty_ = true;
+  return count;
+}
+
+void PixelStrip::show() {
+  if(!open_) return;
+  if(dirty_) {
+    gpioStripWrite(frame_.data(), frame_.size());
+    dirty_ = false;
+    pending_ = true;
+  }
+  if(!pending_) return;
+  if(gpioStripShow() == PI_STRIP_BUSY) {
+    retry_.start([this]() { show(); }, RETRY);
+    return;
+  }
+  pending_ = false;
+}
+
+void PixelStrip::close() {
+  retry_.close();
+  if(!open_) return;
+  std::fill(frame_.begin(), frame_.end(), 0);
+  gpioStripWrite(frame_.data(), frame_.size());
+  while(gpioStripShow() == PI_STRIP_BUSY) gpioDelay(1000);
+  // Let the blank frame go out before the DMA channel is reset
+  while(gpioStripShow() == PI_STRIP_BUSY) gpioDelay(1000);
+  gpioStripClose();
+  open_ = false;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef LEDPI_PIXEL_STRIP_H
+#define LEDPI_PIXEL_STRIP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Uv.h"
+#include "state.capnp.h"
+
+namespace ledpi {
+
+// A WS2812 or SK6812 strip on the PWM peripheral (see gpioStripOpen), set a
+// run of pixels at a time. Setting only touches the frame in memory; show
+// hands it to pigpio, which encodes it while the last one may still be going
+// out, so it belongs in the frame scheduler's flush.
+class PixelStrip {
+  // How soon to try again when the last frame hasn't finished
+  static constexpr std::chrono::milliseconds RETRY{1};
+
+  common::uv::Timer retry_;
+  std::vector<char> frame_;
+  size_t pixel_size_;
+  bool open_ = false;
+  bool dirty_ = false;    // frame_ has changed since it was last written
+  bool pending_ = false;  // written, waiting for the strip to be free
+
+public:
+  // Strip bytes pigpio must be configured for before gpioInitialise
+  static size_t bytes(proto::Strip::Reader config);
+
+  PixelStrip(common::uv::Loop &loop, proto::Strip::Reader config);
+
+  // Copy in pixels packed in the strip's byte order, from pixel first on.
+  // Returns how many fit.
+  size_t set(size_t first, const uint8_t *pixels, size_t size);
+  void show();
+
+  const std::vector<char> &frame() const { return frame_; }
+
+  // Blanks the strip and lets go of the PWM peripheral
+  void close();
+};
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include "PwmOutput.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+using namespace common;
+
+namespace ledpi {
+
+namespace {
+// Sent over DMX, SPI or I2C rather than from the gpio
+bool offboard(Channel::Reader channel) {
+  return channel.getDmxSlot() || channel.getSpiOutput() || channel.getPca9685Output();
+}
+
+// Driven here; setup has complained about gpios past the DMA engine's
+bool driven(Channel::Reader channel) {
+  return !offboard(channel) && channel.getGpio() <= PI_MAX_USER_GPIO;
+}
+
+unsigned dutyRange(Channel::Reader channel) {
+  return channel.getRange() ? channel.getRange() : PI_MAX_DUTYCYCLE_RANGE;
+}
+
+unsigned duty(uint16_t level, unsigned range) {
+  return (static_cast<uint32_t>(UINT16_MAX - level) * range) / UINT16_MAX;
+}
+
+unsigned hardwareDuty(uint16_t level) {
+  return (static_cast<uint64_t>(UINT16_MAX - level) * PI_HW_PWM_RANGE) / UINT16_MAX;
+}
+}
+
+constexpr std::chrono::microseconds PwmOutput::RAMP_SPAN;
+
+PwmOutput::PwmOutput(uv::Loop &loop, std::chrono::milliseconds step)
+    : loop_(loop), timer_(loop), step_(step) {}
+
+void PwmOutput::setup(proto::State::Builder state) {
+  corrections_.clear();
+  ramps_.assign(state.getChannels().size(), Ramp());
+  ramping_ = 0;
+  timer_.stop();
+  for(auto channel : state.getChannels()) {
+    corrections_.emplace_back(channel);
+    if(offboard(channel)) continue;
+    auto gpio = channel.getGpio();
+    if(gpio > PI_MAX_USER_GPIO) {
+      fprintf(stderr, "gpio %u of %s is past %d, not driven\n", gpio, channel.getName().cStr(), PI_MAX_USER_GPIO);
+      continue;
+    }
+    if(channel.getHardwarePwm()) {
+      if(gpioHardwarePWM(gpio, channel.getHardwarePwm(), PI_HW_PWM_RANGE) < 0) {
+        fprintf(stderr, "hardware PWM at %u Hz unavailable on gpio %u\n",
+                channel.getHardwarePwm(), gpio);
+      }
+    } else {
+      if(channel.getFrequency() && gpioSetPWMfrequency(gpio, channel.getFrequency()) < 0) {
+        fprintf(stderr, "PWM at %u Hz unavailable on gpio %u\n", channel.getFrequency(), gpio);
+      }
+      if(gpioSetPWMrange(gpio, dutyRange(channel)) < 0) {
+        fprintf(stderr, "bad PWM range %u on gpio %u\n", channel.getRange(), gpio);
+        channel.setRange(0);
+        gpioSetPWMrange(gpio, dutyRange(channel));
+      }
+      gpioPWM(gpio, dutyRange(channel));
+    }
+
+    int real_range = gpioGetPWMrealRange(gpio);
+    channel.setRealRange(real_range < 0 ? 0 : real_range);
+    printf("gpio %u: %d Hz, %u steps\n", gpio, gpioGetPWMfrequency(gpio), channel.getRealRange());
+  }
+}
+
+void PwmOutput::apply(proto::State::Reader state, const ChannelMask &changed) {
+  auto levels = state.getLevels();
+  auto channels = state.getChannels();
+  // Plain channels go to the DMA tables together so they change in the same cycle
+  uint32_t gpios = 0;
+  unsigned duties[32];
+  for(size_t i = 0; i < levels.size(); ++i) {
+    if(i < changed.size() && !changed[i]) continue;
+    if(!driven(channels[i])) continue;
+    uint16_t power = corrections_[i](levels[i]);
+    if(channels[i].getHardwarePwm()) {
+      stop(i);
+      gpioHardwarePWM(channels[i].getGpio(), channels[i].getHardwarePwm(), hardwareDuty(power));
+    } else if(channels[i].getDither()) {
+      gpioPWMDither(channels[i].getGpio(), UINT16_MAX - power, UINT16_MAX);
+    } else {
+      gpios |= 1u << channels[i].getGpio();
+      duties[channels[i].getGpio()] = duty(power, dutyRange(channels[i]));
+    }
+  }
+  if(gpios) gpioPWMMulti(gpios, duties);
+}
+
+void PwmOutput::ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) {
+  auto config = state.getChannels()[channel];
+  if(!driven(config)) return;
+  // The ramp is linear in power between the corrected ends, close enough
+  // over one span
+  from = corrections_[channel](from);
+  to = corrections_[channel](to);
+  if(config.getHardwarePwm()) {
+    // The fader only comes back a tick later, too coarse a step to see
+    // through, so the timer takes it from here
+    gpioHardwarePWM(config.getGpio(), config.getHardwarePwm(), hardwareDuty(from));
+    auto &ramp = ramps_[channel];
+    if(!ramp.active) {
+      ramp.active = true;
+      if(ramping_++ == 0) timer_.start([this]() { step(); }, step_, step_);
+    }
+    ramp.gpio = config.getGpio();
+    ramp.frequency = config.getHardwarePwm();
+    ramp.from = from;
+    ramp.to = to;
+    ramp.start = loop_.now();
+    return;
+  }
+  gpioPWMRamp(config.getGpio(), duty(from, dutyRange(config)), duty(to, dutyRange(config)));
+}
+
+void PwmOutput::stop(size_t channel) {
+  if(!ramps_[channel].active) return;
+  ramps_[channel].active = false;
+  if(--ramping_ == 0) timer_.stop();
+}
+
+void PwmOutput::step() {
+  auto now = loop_.now();
+  for(size_t i = 0; i < ramps_.size(); ++i) {
+    auto &ramp = ramps_[i];
+    if(!ramp.active) continue;
+    auto elapsed = std::min(std::chrono::duration_cast<std::chrono::microseconds>(now - ramp.start), RAMP_SPAN);
+    int32_t power = ramp.from + (static_cast<int32_t>(ramp.to) - ramp.from) * elapsed.count() / RAMP_SPAN.count();
+    gpioHardwarePWM(ramp.gpio, ramp.frequency, hardwareDuty(power));
+    if(elapsed >= RAMP_SPAN) stop(i);
+  }
+}
+
+}
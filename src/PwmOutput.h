@@ -0,0 +1,55 @@
+#ifndef LEDPI_PWM_OUTPUT_H
+#define LEDPI_PWM_OUTPUT_H
+
+#include <chrono>
+#include <vector>
+
+#include "Correction.h"
+#include "Output.h"
+#include "Uv.h"
+#include "pigpio.h"
+
+namespace ledpi {
+
+// PWM on each channel's gpio, through pigpio's DMA engine or a hardware PWM
+// channel, at the power each channel's correction gives its level. Channels
+// sent over DMX, SPI or I2C are left alone.
+class PwmOutput : public Output {
+public:
+  // Length of a gpioPWMRamp at the default sample rate
+  static constexpr std::chrono::microseconds RAMP_SPAN{800 * 25 * PI_DEFAULT_CLK_MICROS};
+
+private:
+  // A hardware PWM channel's way across a ramp, which a timer steps along
+  // since the PWM peripheral has nothing to precompute into
+  struct Ramp {
+    bool active = false;
+    unsigned gpio, frequency;
+    uint16_t from, to;
+    common::uv::Clock::time_point start;
+  };
+
+  common::uv::Loop &loop_;
+  common::uv::Timer timer_;
+  std::chrono::milliseconds step_;
+  std::vector<Correction> corrections_;
+  std::vector<Ramp> ramps_;
+  size_t ramping_ = 0;
+
+  void stop(size_t channel);
+  void step();
+
+public:
+  // Hardware PWM channels are stepped through their ramps every step
+  PwmOutput(common::uv::Loop &loop, std::chrono::milliseconds step);
+
+  void setup(proto::State::Builder state) override;
+  void apply(proto::State::Reader state, const ChannelMask &changed) override;
+  void ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) override;
+
+  void close() { timer_.close(); }
+};
+
+}
+
+#endif
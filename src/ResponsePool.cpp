@@ -0,0 +1,67 @@
+#include "ResponsePool.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace ledpi {
+
+constexpr size_t ResponsePool::SLOTS;
+constexpr size_t ResponsePool::ARENA_WORDS;
+constexpr size_t ResponsePool::Slot::MAX_SEGMENTS;
+
+ResponsePool::ResponsePool() {
+  free_.reserve(SLOTS);
+  for(auto &slot : slots_) {
+    slot.pool_ = this;
+    free_.push_back(&slot);
+  }
+}
+
+ResponsePool::Slot *ResponsePool::acquire() {
+  if(free_.empty()) {
+    // Only log the first drop of a burst
+    if(dropped_++ == 0 || dropped_ % 1000 == 0) {
+      fprintf(stderr, "all %zu response slots in flight, %zu responses dropped\n", SLOTS, dropped_);
+    }
+    return nullptr;
+  }
+  Slot *slot = free_.back();
+  free_.pop_back();
+  new (&slot->builder_) capnp::MallocMessageBuilder(kj::arrayPtr(slot->arena_.data(), slot->arena_.size()));
+  return slot;
+}
+
+void ResponsePool::release(Slot *slot) {
+  auto segments = slot->builder().getSegmentsForOutput();
+  size_t used = segments.size() ? segments[0].size() : 0;
+  slot->builder().~MallocMessageBuilder();
+  // MallocMessageBuilder wants its first segment zeroed
+  memset(slot->arena_.data(), 0, used * sizeof(capnp::word));
+  free_.push_back(slot);
+}
+
+void ResponsePool::send(Slot *slot, common::uv::UDP &udp, const struct sockaddr *addr) {
+  auto segments = slot->builder().getSegmentsForOutput();
+  if(segments.size() > Slot::MAX_SEGMENTS) {
+    fprintf(stderr, "response of %zu segments too large to send\n", segments.size());
+    release(slot);
+    return;
+  }
+  for(size_t i = 0; i < segments.size(); ++i) {
+    slot->bufs_[i].base = const_cast<char *>(reinterpret_cast<const char *>(segments[i].begin()));
+    slot->bufs_[i].len = sizeof(segments[i][0]) * segments[i].size();
+  }
+  // Small enough for std::function to keep without allocating
+  int result = slot->send_.send(udp, slot->bufs_, segments.size(), addr, [slot](int result) {
+      if(result < 0) {
+        fprintf(stderr, "error sending response: %s\n", uv_strerror(result));
+      }
+      slot->pool_->release(slot);
+    });
+  if(result < 0) {
+    fprintf(stderr, "error sending response: %s\n", uv_strerror(result));
+    release(slot);
+  }
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef LEDPI_RESPONSE_POOL_H
+#define LEDPI_RESPONSE_POOL_H
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <capnp/message.h>
+
+#include "Uv.h"
+
+namespace ledpi {
+
+// Preallocated slots for UDP responses, so answering a command touches no heap.
+// Each slot builds its message over its own zeroed scratch arena and owns the
+// send request, and goes back to the pool once the send completes. When every
+// slot is in flight, further responses are dropped; clients retry anyway.
+class ResponsePool {
+public:
+  static constexpr size_t SLOTS = 32;
+  // Large enough for a channel list; bigger messages spill onto the heap
+  static constexpr size_t ARENA_WORDS = 512;
+
+  class Slot {
+    friend class ResponsePool;
+
+    ResponsePool *pool_ = nullptr;
+    std::array<capnp::word, ARENA_WORDS> arena_{};
+    typename std::aligned_storage<sizeof(capnp::MallocMessageBuilder),
+                                  alignof(capnp::MallocMessageBuilder)>::type builder_;
+    common::uv::UDPSend send_;
+    static constexpr size_t MAX_SEGMENTS = 8;
+    uv_buf_t bufs_[MAX_SEGMENTS];
+
+    capnp::MallocMessageBuilder &builder() {
+      return *reinterpret_cast<capnp::MallocMessageBuilder *>(&builder_);
+    }
+
+  public:
+    capnp::MessageBuilder &message() { return builder(); }
+  };
+
+private:
+  std::array<Slot, SLOTS> slots_;
+  std::vector<Slot *> free_;
+  size_t dropped_ = 0;
+
+public:
+  ResponsePool();
+  ResponsePool(const ResponsePool &) = delete;
+  ResponsePool &operator=(const ResponsePool &) = delete;
+
+  // A slot with an empty message, or nullptr when all are in flight
+  Slot *acquire();
+
+  // Send the slot's message to addr, returning the slot to the pool once sent
+  void send(Slot *slot, common::uv::UDP &udp, const struct sockaddr *addr);
+
+  // Return a slot unsent, as when building its message failed
+  void release(Slot *slot);
+
+  size_t dropped() const { return dropped_; }
+};
+
+}
+
+#endif
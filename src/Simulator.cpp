@@ -0,0 +1,103 @@
+#include "Simulator.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "pigpio.h"
+
+using namespace common;
+
+namespace ledpi {
+
+namespace {
+// Length of one simulated PWM cycle: 25 pulses at the default sample rate
+constexpr uint64_t CYCLE_NANOS = 25 * PI_DEFAULT_CLK_MICROS * 1000;
+}
+
+Simulator::Simulator(uv::Loop &loop, std::chrono::milliseconds period)
+    : timer_(loop), last_(uv::HRClock().now()) {
+  timer_.start([this]() { step(); }, period, period);
+}
+
+void Simulator::step() {
+  auto now = uv::HRClock().now();
+  remainder_ += (now - last_).count();
+  last_ = now;
+
+  unsigned cycles = remainder_ / CYCLE_NANOS;
+  remainder_ %= CYCLE_NANOS;
+
+  uint32_t high[32] = {};
+  int result = gpioSimStep(cycles, high);
+  if(result < 0) {
+    fprintf(stderr, "simulation failed: %d\n", result);
+    timer_.stop();
+    return;
+  }
+
+  pulses_ += result;
+  for(size_t i = 0; i < high_.size(); ++i) {
+    high_[i] += high[i];
+  }
+}
+
+void Simulator::reportStrip(const std::vector<char> &expected) const {
+  std::vector<char> sent(PI_MAX_STRIP_BYTES);
+  int result = gpioSimStripRead(sent.data(), sent.size());
+  if(result < 0) {
+    printf("simulated strip unreadable: %d\n", result);
+    return;
+  }
+  sent.resize(result);
+  printf("simulated strip sent %d bytes, %s the frame set:", result, sent == expected ? "matching" : "differing from");
+  for(size_t i = 0; i < std::min<size_t>(sent.size(), 12); ++i) {
+    printf(" %02x", static_cast<uint8_t>(sent[i]));
+  }
+  printf(sent.size() > 12 ? " ...\n" : "\n");
+}
+
+void Simulator::reportSpi(const std::vector<char> &expected, size_t applies) const {
+  std::vector<char> sent(PI_MAX_SPI_DEVICE_COUNT);
+  unsigned transfers;
+  int result = gpioSimSpiRead(sent.data(), sent.size(), &transfers);
+  if(result < 0) {
+    printf("simulated SPI unreadable: %d\n", result);
+    return;
+  }
+  sent.resize(result);
+  printf("simulated SPI: %u transfers for %zu applies, the last %d bytes %s the frame packed:", transfers, applies,
+         result, sent == expected ? "matching" : "differing from");
+  for(size_t i = 0; i < std::min<size_t>(sent.size(), 12); ++i) {
+    printf(" %02x", static_cast<uint8_t>(sent[i]));
+  }
+  printf(sent.size() > 12 ? " ...\n" : "\n");
+}
+
+void Simulator::reportPca9685(unsigned bus, const std::vector<uint8_t> &addresses, size_t applies) const {
+  unsigned bytes;
+  int transactions = gpioSimI2cTraffic(bus, &bytes);
+  if(transactions < 0) {
+    printf("simulated I2C bus %u unreadable: %d\n", bus, transactions);
+    return;
+  }
+  printf("simulated I2C bus %u: %d transactions, %u bytes, for %zu applies\n", bus, transactions, bytes, applies);
+  for(auto address : addresses) {
+    char regs[64];
+    if(gpioSimI2cRead(bus, address, 0x06, regs, sizeof(regs)) < 0) continue;
+    printf("  PCA9685 0x%02x duty:", address);
+    for(size_t led = 0; led < 16; ++led) {
+      const uint8_t *r = reinterpret_cast<const uint8_t *>(&regs[4 * led]);
+      unsigned on = r[0] | (r[1] & 0xf) << 8, off = r[2] | (r[3] & 0xf) << 8;
+      double duty = (r[3] & 0x10) ? 0 : (r[1] & 0x10) ? 1 : ((off - on) & 0xfff) / 4096.0;
+      printf(" %.4f", duty);
+    }
+    printf("\n");
+  }
+}
+
+double Simulator::duty(unsigned gpio) const {
+  if(pulses_ == 0 || gpio >= high_.size()) return 0;
+  return static_cast<double>(high_[gpio]) / pulses_;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef LEDPI_SIMULATOR_H
+#define LEDPI_SIMULATOR_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "Uv.h"
+
+namespace ledpi {
+
+// Drives pigpio's simulated DMA engine (see gpioCfgSimulation) in step with
+// the wall clock, keeping a tally of how long each gpio has been high.
+class Simulator {
+  common::uv::Timer timer_;
+  common::uv::HRClock::time_point last_;
+  uint64_t remainder_ = 0;  // ns not yet executed
+  uint64_t pulses_ = 0;
+  std::array<uint64_t, 32> high_{};
+
+  void step();
+
+public:
+  Simulator(common::uv::Loop &loop, std::chrono::milliseconds period);
+
+  void close() { timer_.close(); }
+
+  // Fraction of the executed pulses during which gpio was high
+  double duty(unsigned gpio) const;
+  uint64_t pulses() const { return pulses_; }
+
+  // Decodes the last frame the pixel strip was sent and reports how it
+  // compares with the frame meant for it
+  void reportStrip(const std::vector<char> &expected) const;
+  // Reports the SPI transfers, against the applies they came from, and
+  // whether the last matches the frame expected
+  void reportSpi(const std::vector<char> &expected, size_t applies) const;
+  // Reports the traffic on an I2C bus, against the applies it came from,
+  // and the duty each PCA9685 on it was left at
+  void reportPca9685(unsigned bus, const std::vector<uint8_t> &addresses, size_t applies) const;
+};
+
+}
+
+#endif
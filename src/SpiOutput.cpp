@@ -0,0 +1,151 @@
+#include "SpiOutput.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "pigpio.h"
+
+namespace ledpi {
+
+namespace {
+const char *chipName(proto::SpiOutput::Chip chip) {
+  switch(chip) {
+  case proto::SpiOutput::Chip::APA102: return "APA102";
+  case proto::SpiOutput::Chip::TLC59711: return "TLC59711";
+  default: return "no";
+  }
+}
+
+// Bytes in a frame for a chain of devices
+size_t frameSize(proto::SpiOutput::Chip chip, size_t devices) {
+  if(chip == proto::SpiOutput::Chip::APA102) return 4 + 4 * devices + (devices + 15) / 16;
+  return 28 * devices;
+}
+
+void putWord(char *&out, uint16_t word) {
+  *out++ = word >> 8;
+  *out++ = word & 0xff;
+}
+}
+
+constexpr size_t SpiOutput::APA102_OUTPUTS;
+constexpr size_t SpiOutput::TLC59711_OUTPUTS;
+
+void SpiOutput::setup(proto::State::Builder state) {
+  auto config = state.getSpiOutput();
+  chip_ = config.getChip();
+  size_t per = chip_ == proto::SpiOutput::Chip::APA102 ? APA102_OUTPUTS : TLC59711_OUTPUTS;
+
+  size_t highest = 0;
+  for(auto channel : state.getChannels()) {
+    highest = std::max<size_t>(highest, channel.getSpiOutput());
+  }
+  size_t devices = config.getDevices() ? config.getDevices() : (highest + per - 1) / per;
+  if(frameSize(chip_, devices) > PI_MAX_SPI_DEVICE_COUNT) {
+    fprintf(stderr, "SPI chain of %zu %s devices is too long for a transfer\n", devices, chipName(chip_));
+    devices = 0;
+  }
+
+  corrections_.clear();
+  outputs_.clear();
+  for(auto channel : state.getChannels()) {
+    corrections_.emplace_back(channel);
+    size_t output = channel.getSpiOutput();
+    if(output > devices * per) {
+      fprintf(stderr, "SPI output %zu of %s is past the chain\n", output, channel.getName().cStr());
+      output = 0;
+    }
+    outputs_.push_back(output);
+  }
+  powers_.assign(devices * per, 0);
+  frame_.assign(frameSize(chip_, devices), 0);
+  // The drivers come up in no particular state, so the first apply sends
+  dirty_ = true;
+
+  handle_ = spiOpen(config.getChannel(), config.getBaud(), 0);
+  if(handle_ < 0) {
+    fprintf(stderr, "SPI output on CE%u unavailable: %d\n", config.getChannel(), handle_);
+    return;
+  }
+  printf("SPI on CE%u: %zu %s devices, %zu bytes a frame at %u baud\n", config.getChannel(), devices,
+         chipName(chip_), frame_.size(), config.getBaud());
+}
+
+void SpiOutput::put(size_t channel, uint16_t power) {
+  auto &current = powers_[outputs_[channel] - 1];
+  if(current == power) return;
+  current = power;
+  dirty_ = true;
+}
+
+void SpiOutput::packApa102() {
+  // A zero start frame, then each pixel's brightness, blue, green and red.
+  // The brightness is the least that reaches the brightest of the three, so
+  // dim pixels keep more of the 8-bit steps.
+  char *out = frame_.data() + 4;
+  for(size_t p = 0; p < powers_.size(); p += APA102_OUTPUTS) {
+    uint16_t red = powers_[p], green = powers_[p + 1], blue = powers_[p + 2];
+    uint32_t brightest = std::max({red, green, blue});
+    uint32_t brightness = (brightest * 31 + UINT16_MAX - 1) / UINT16_MAX;
+    if(brightness == 0) brightness = 1;
+    auto scale = [brightness](uint16_t power) -> char {
+      return (power * 31 + brightness * 257 / 2) / (brightness * 257);
+    };
+    *out++ = 0xe0 | brightness;
+    *out++ = scale(blue);
+    *out++ = scale(green);
+    *out++ = scale(red);
+  }
+  // The zero end frame is left as it is; it only supplies the clocks the
+  // data needs to ripple down the chain
+}
+
+void SpiOutput::packTlc59711() {
+  // The chain is one long shift register, so the chip furthest along goes
+  // first, each as a write command with full brightness then its outputs
+  // from the last down
+  const uint32_t command = 0x25u << 26  // write
+      | 0x16u << 21  // OUTTMG, TMGRST and DSPRPT
+      | 0x7fu << 14 | 0x7fu << 7 | 0x7fu;  // brightness of each color group
+  char *out = frame_.data();
+  for(size_t chip = powers_.size() / TLC59711_OUTPUTS; chip-- > 0;) {
+    putWord(out, command >> 16);
+    putWord(out, command & 0xffff);
+    for(size_t i = TLC59711_OUTPUTS; i-- > 0;) {
+      putWord(out, powers_[chip * TLC59711_OUTPUTS + i]);
+    }
+  }
+}
+
+void SpiOutput::apply(proto::State::Reader state, const ChannelMask &changed) {
+  ++applies_;
+  auto levels = state.getLevels();
+  for(size_t i = 0; i < levels.size(); ++i) {
+    if(i < changed.size() && !changed[i]) continue;
+    if(outputs_[i] == 0) continue;
+    put(i, corrections_[i](levels[i]));
+  }
+  if(!dirty_ || handle_ < 0) return;
+
+  if(chip_ == proto::SpiOutput::Chip::APA102) packApa102();
+  else packTlc59711();
+  if(spiWrite(handle_, frame_.data(), frame_.size()) < 0) {
+    fprintf(stderr, "SPI write failed\n");
+  }
+  dirty_ = false;
+}
+
+void SpiOutput::ramp(proto::State::Reader, size_t channel, uint16_t from, uint16_t) {
+  // The fader flushes after handing out each tick's ramps, so `from` goes
+  // out with the rest of the frame rather than in a transfer of its own
+  if(outputs_[channel] == 0) return;
+  put(channel, corrections_[channel](from));
+}
+
+void SpiOutput::close() {
+  if(handle_ < 0) return;
+  spiClose(handle_);
+  handle_ = -1;
+}
+
+}
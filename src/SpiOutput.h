@@ -0,0 +1,49 @@
+#ifndef LEDPI_SPI_OUTPUT_H
+#define LEDPI_SPI_OUTPUT_H
+
+#include <vector>
+
+#include "Correction.h"
+#include "Output.h"
+
+namespace ledpi {
+
+// A chain of LED drivers on the SPI bus, APA102 pixels or TLC59711s, driving
+// the channels with an spiOutput at each one's corrected power. The drivers
+// hold their outputs between frames, so the chain is sent the whole frame in
+// one transfer, and only when an output's power has changed.
+class SpiOutput : public Output {
+public:
+  static constexpr size_t APA102_OUTPUTS = 3;
+  static constexpr size_t TLC59711_OUTPUTS = 12;
+
+private:
+  proto::SpiOutput::Chip chip_ = proto::SpiOutput::Chip::NONE;
+  int handle_ = -1;
+  std::vector<Correction> corrections_;
+  std::vector<size_t> outputs_;  // by channel, counting from 1, 0 for none
+  std::vector<uint16_t> powers_;  // by output along the chain
+  std::vector<char> frame_;
+  bool dirty_ = false;
+  size_t applies_ = 0;
+
+  void put(size_t channel, uint16_t power);
+  void packApa102();
+  void packTlc59711();
+
+public:
+  void setup(proto::State::Builder state) override;
+  void apply(proto::State::Reader state, const ChannelMask &changed) override;
+  void ramp(proto::State::Reader state, size_t channel, uint16_t from, uint16_t to) override;
+
+  void close();
+
+  // The last frame packed, and how many times apply was called, for
+  // checking against the transfers
+  const std::vector<char> &frame() const { return frame_; }
+  size_t applies() const { return applies_; }
+};
+
+}
+
+#endif
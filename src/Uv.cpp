@@ -70,6 +70,11 @@ void Poll::callback_(uv_poll_t *handle, int status, int events) {
   self.func_(status, events);
 }
 
+void Check::callback_(uv_check_t *handle) {
+  Check &self = *reinterpret_cast<Check*>(handle);
+  self.func_();
+}
+
 void UDP::allocCB_(uv_handle_t *handle, size_t suggestedSize, uv_buf_t *buf) {
   UDP &self = *reinterpret_cast<UDP*>(handle);
   self.allocFunc_(suggestedSize, buf);
@@ -84,3 +89,12 @@ void UDPSend::finish_(uv_udp_send_t *req, int status) {
   UDPSend &self = *reinterpret_cast<UDPSend*>(req);
   self.finishCB_(status);
 }
+
+void Fs::finish_(uv_fs_t *req) {
+  Fs &self = *reinterpret_cast<Fs*>(req);
+  ssize_t result = req->result;
+  uv_fs_req_cleanup(req);
+  // The callback may start the next operation, which replaces finishCB_
+  auto finishCB = std::move(self.finishCB_);
+  finishCB(result);
+}
@@ -243,6 +243,25 @@ public:
   void stop() { uv_poll_stop(&handle); }
 };
 
+// Runs once per loop iteration, right after I/O callbacks
+class Check : public Handle<uv_check_t> {
+  std::function<void ()> func_;
+
+  static void callback_(uv_check_t *handle);
+
+public:
+  Check(Loop &loop) {
+    uv_check_init(loop, &handle);
+  }
+
+  void start(std::function<void ()> func) {
+    func_ = std::move(func);
+    uv_check_start(&handle, callback_);
+  }
+
+  void stop() { uv_check_stop(&handle); }
+};
+
 typedef void AllocCallback(size_t minimumSize, uv_buf_t *out);
 
 class UDP : public Handle<uv_udp_t> {
@@ -262,6 +281,11 @@ public:
     uv_udp_init(loop, &handle);
   }
 
+  // flags as for uv_udp_init_ex, e.g. UV_UDP_RECVMMSG
+  UDP(Loop &loop, unsigned flags) {
+    uv_udp_init_ex(loop, &handle, AF_UNSPEC | flags);
+  }
+
   int bind(const struct sockaddr *address, unsigned flags = 0) {
     assert(!empty);
     return uv_udp_bind(&handle, address, flags);
@@ -276,6 +300,14 @@ public:
   int recvStop() { return uv_udp_recv_stop(&handle); }
 
   int set_broadcast(bool state) { return uv_udp_set_broadcast(&handle, state); }
+
+  // Join or leave an IPv4 or IPv6 group, on the interface with the given
+  // address or, if null, one the kernel picks
+  int set_membership(const char *group, const char *interfaceAddr, uv_membership membership) {
+    return uv_udp_set_membership(&handle, group, interfaceAddr, membership);
+  }
+  int set_multicast_loop(bool on) { return uv_udp_set_multicast_loop(&handle, on); }
+  int set_multicast_ttl(int ttl) { return uv_udp_set_multicast_ttl(&handle, ttl); }
 };
 
 template<typename T>
@@ -295,10 +327,56 @@ class UDPSend : public Request<uv_udp_send_t> {
   std::function<void(int)> finishCB_;
 
 public:
-  void send(UDP &udp, const uv_buf_t bufs[], unsigned nbufs, const struct sockaddr *addr,
-            std::function<void(int)> finishCB) {
+  // On an error return, finishCB is never called
+  int send(UDP &udp, const uv_buf_t bufs[], unsigned nbufs, const struct sockaddr *addr,
+           std::function<void(int)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return uv_udp_send(&handle, &udp.handle, bufs, nbufs, addr, finish_);
+  }
+};
+
+// Filesystem operations run on the libuv thread pool. Each completes by calling
+// back with the result, after which the same object may start the next one.
+class Fs : public Request<uv_fs_t> {
+  static void finish_(uv_fs_t *req);
+
+  std::function<void(ssize_t)> finishCB_;
+
+  int start_(int result) {
+    if(result < 0) finishCB_ = nullptr;
+    return result;
+  }
+
+public:
+  int open(Loop &loop, const char *path, int flags, int mode, std::function<void(ssize_t)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return start_(uv_fs_open(loop, &handle, path, flags, mode, finish_));
+  }
+
+  int write(Loop &loop, uv_file file, const uv_buf_t bufs[], unsigned nbufs, int64_t offset,
+            std::function<void(ssize_t)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return start_(uv_fs_write(loop, &handle, file, bufs, nbufs, offset, finish_));
+  }
+
+  int fsync(Loop &loop, uv_file file, std::function<void(ssize_t)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return start_(uv_fs_fsync(loop, &handle, file, finish_));
+  }
+
+  int close(Loop &loop, uv_file file, std::function<void(ssize_t)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return start_(uv_fs_close(loop, &handle, file, finish_));
+  }
+
+  int ftruncate(Loop &loop, uv_file file, int64_t offset, std::function<void(ssize_t)> finishCB) {
+    finishCB_ = std::move(finishCB);
+    return start_(uv_fs_ftruncate(loop, &handle, file, offset, finish_));
+  }
+
+  int rename(Loop &loop, const char *path, const char *newPath, std::function<void(ssize_t)> finishCB) {
     finishCB_ = std::move(finishCB);
-    uv_udp_send(&handle, &udp.handle, bufs, nbufs, addr, finish_);
+    return start_(uv_fs_rename(loop, &handle, path, newPath, finish_));
   }
 };
 }
@@ -0,0 +1,31 @@
+#ifndef LEDPI_ZONE_H
+#define LEDPI_ZONE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace ledpi {
+
+// Lamps in a zone join that zone's multicast groups, so a controller reaches
+// all of them with one packet and other lamps' kernels drop it. Zone 0 is
+// no zone: such lamps only hear broadcasts and unicasts.
+constexpr uint16_t NO_ZONE = 0;
+
+// Administratively scoped, 239.255.0.1 through 239.255.255.255
+inline std::string zoneGroup4(uint16_t zone) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "239.255.%u.%u", zone >> 8, zone & 0xff);
+  return buf;
+}
+
+// Link-local scope
+inline std::string zoneGroup6(uint16_t zone) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "ff02::4242:%x", zone);
+  return buf;
+}
+
+}
+
+#endif
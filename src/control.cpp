@@ -1,14 +1,21 @@
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
 #include <vector>
 
+#include <unistd.h>
+
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 
 #include "Uv.h"
+#include "Zone.h"
 #include "command.capnp.h"
 
 using namespace common;
+using namespace ledpi;
 
 constexpr const char* channels[] = {"red", "green", "blue", "white"};
 
@@ -19,22 +26,200 @@ void static_buffer_alloc_cb(size_t, uv_buf_t * buf) {
   buf->base = buffer;
   buf->len = length;
 }
+
+// Resends of an unacknowledged command
+constexpr int RETRIES = 3;
+constexpr std::chrono::milliseconds RETRY_PERIOD(250);
+
+// How long to collect clock answers from lamps for
+constexpr std::chrono::milliseconds SYNC_WINDOW(500);
+
+int usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [-a] [-z zone] [-d delay-ms] [-t fade-ms] <channel>{4}\n"
+          "       %s [-a] [-z zone] [-d delay-ms] -Z new-zone | -S scene [-t fade-ms] | -R scene | -l | -C\n"
+          "       %s [-a] [-z zone] [-d delay-ms] [-t fade-ms] [-i intensity] -c color\n"
+          "       %s [-z zone] [-d delay-ms] -x first:pixels\n"
+          "\tchannel = real | \"x\" real\n"
+          "\t-a: wait for the lamp to acknowledge, resending if needed\n"
+          "\t-z: only address the lamps in this zone, rather than all of them\n"
+          "\t-Z: move the lamps to another zone, 0 for none\n"
+          "\t-S: save the current levels as a scene, recalled by fading over fade-ms\n"
+          "\t-R: recall a scene\n"
+          "\t-l: list the saved scenes\n"
+          "\t-d: carry the command out this long from now, at the same time on every\n"
+          "\t    lamp whose clock was synchronized\n"
+          "\t-C: synchronize the lamps' clocks with this machine's\n"
+          "\t-c: mix a color, given as CIE 1931 x,y or as a color temperature like 2700K\n"
+          "\t-i: brightness of the color, 0-1 of the most it can be mixed at (default 1)\n"
+          "\t-x: set the strip's pixels from first on, given in hex in the strip's byte\n"
+          "\t    order, like 0:ff000000ff00 for a red then a green GRB pixel\n",
+          argv0, argv0, argv0, argv0);
+  return 1;
+}
+
+bool parseZone(const char *arg, uint16_t *zone) {
+  char *endptr;
+  long value = strtol(arg, &endptr, 10);
+  if(*endptr != '\0' || value < 0 || value > UINT16_MAX) {
+    fprintf(stderr, "invalid zone (should be an integer from 0 to %u): %s\n", UINT16_MAX, arg);
+    return false;
+  }
+  *zone = value;
+  return true;
+}
 }
 
 int main(int argc, char **argv) {
   capnp::MallocMessageBuilder message;
   auto cmd = message.initRoot<proto::Command>();
 
-  switch(argc) {
-  case 1: {
-    cmd.setGetName();
+  long fade_ms = -1;
+  bool ack = false;
+  uint16_t zone = NO_ZONE;
+  bool set_zone = false;
+  uint16_t new_zone = NO_ZONE;
+  const char *save_scene = nullptr;
+  const char *recall_scene = nullptr;
+  bool list_scenes = false;
+  bool sync_clocks = false;
+  long delay_ms = -1;
+  const char *color = nullptr;
+  float intensity = 1;
+  const char *pixels = nullptr;
+  int opt;
+  while((opt = getopt(argc, argv, "az:Z:S:R:lCd:c:i:t:x:")) != -1) {
+    switch(opt) {
+    case 'a':
+      ack = true;
+      break;
+    case 'z':
+      if(!parseZone(optarg, &zone)) return 1;
+      break;
+    case 'Z':
+      if(!parseZone(optarg, &new_zone)) return 1;
+      set_zone = true;
+      break;
+    case 'S':
+      save_scene = optarg;
+      break;
+    case 'R':
+      recall_scene = optarg;
+      break;
+    case 'l':
+      list_scenes = true;
+      break;
+    case 'C':
+      sync_clocks = true;
+      break;
+    case 'c':
+      color = optarg;
+      break;
+    case 'x':
+      pixels = optarg;
+      break;
+    case 'i': {
+      char *endptr;
+      intensity = strtof(optarg, &endptr);
+      if(*endptr != '\0' || intensity < 0 || intensity > 1) {
+        fprintf(stderr, "invalid intensity (should be between 0 and 1 inclusive): %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'd': {
+      char *endptr;
+      delay_ms = strtol(optarg, &endptr, 10);
+      if(*endptr != '\0' || delay_ms < 0) {
+        fprintf(stderr, "invalid delay (should be a nonnegative integer of milliseconds): %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 't': {
+      char *endptr;
+      fade_ms = strtol(optarg, &endptr, 10);
+      if(*endptr != '\0' || fade_ms < 0) {
+        fprintf(stderr, "invalid fade time (should be a nonnegative integer of milliseconds): %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    default:
+      return usage(argv[0]);
+    }
+  }
+  const int args = argc - optind;
+
+  const uint32_t id = static_cast<uint32_t>(uv_hrtime()) ^ getpid();
+  cmd.setId(id);
+  cmd.setAck(ack);
+
+  const int actions = set_zone + (save_scene != nullptr) + (recall_scene != nullptr) + list_scenes + sync_clocks + (color != nullptr) + (pixels != nullptr);
+  if(actions > 1 || (actions && args != 0)) return usage(argv[0]);
+
+  switch(args) {
+  case 0: {
+    if(set_zone) {
+      cmd.setSetZone(new_zone);
+    } else if(save_scene) {
+      auto save = cmd.initSaveScene();
+      save.setName(save_scene);
+      save.setFade(fade_ms > 0 ? fade_ms : 0);
+    } else if(recall_scene) {
+      cmd.setRecallScene(recall_scene);
+    } else if(list_scenes) {
+      cmd.setGetScenes();
+    } else if(sync_clocks) {
+      cmd.setGetClock();
+    } else if(color) {
+      auto set_color = cmd.initSetColor();
+      char *endptr;
+      float value = strtof(color, &endptr);
+      if(endptr != color && (*endptr == 'K' || *endptr == 'k') && endptr[1] == '\0' && value > 0) {
+        set_color.setTemperature(value);
+      } else if(endptr != color && *endptr == ',') {
+        const char *y_arg = endptr + 1;
+        float y = strtof(y_arg, &endptr);
+        if(endptr == y_arg || *endptr != '\0' || value < 0 || y <= 0 || value + y > 1) {
+          fprintf(stderr, "invalid chromaticity (should be x,y with 0 < y and x + y <= 1): %s\n", color);
+          return 1;
+        }
+        auto chromaticity = set_color.initChromaticity();
+        chromaticity.setX(value);
+        chromaticity.setY(y);
+      } else {
+        fprintf(stderr, "invalid color (should be x,y or a temperature like 2700K): %s\n", color);
+        return 1;
+      }
+      set_color.setIntensity(intensity);
+      set_color.setFade(fade_ms > 0 ? fade_ms : 0);
+    } else if(pixels) {
+      char *endptr;
+      long first = strtol(pixels, &endptr, 10);
+      const char *hex = endptr + 1;
+      size_t digits = *endptr == ':' ? strlen(hex) : 0;
+      if(endptr == pixels || first < 0 || digits == 0 || digits % 2 != 0 ||
+         strspn(hex, "0123456789abcdefABCDEF") != digits) {
+        fprintf(stderr, "invalid pixels (should be first:hex bytes): %s\n", pixels);
+        return 1;
+      }
+      auto set_pixels = cmd.initSetPixels();
+      set_pixels.setFirst(first);
+      auto data = set_pixels.initPixels(digits / 2);
+      for(size_t i = 0; i < data.size(); ++i) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        data[i] = strtoul(byte, nullptr, 16);
+      }
+    } else {
+      cmd.setGetName();
+    }
     break;
   }
 
-  case 5: {
+  case 4: {
     auto levels = cmd.initSetPower(4);
     for(int i = 0; i < 4; ++i) {
-      const char *arg = argv[i+1];
+      const char *arg = argv[optind+i];
 
       bool multiply = false;
       if(arg[0] == 'x') {
@@ -50,6 +235,11 @@ int main(int argc, char **argv) {
         return 1;
       }
 
+      if(multiply && fade_ms >= 0) {
+        fprintf(stderr, "%s channel: relative intensities can't be faded\n", channels[i]);
+        return 1;
+      }
+
       if(!multiply && (x < 0 || x > 1)) {
         fprintf(stderr, "invalid %s channel absolute intensity (should be between 0 and 1 inclusive): %s\n", channels[i], arg);
         return 1;
@@ -58,6 +248,11 @@ int main(int argc, char **argv) {
       levels[i].setChannel(i);
       if(multiply) {
         levels[i].setMultiply(x);
+      } else if(fade_ms >= 0) {
+        auto fade = levels[i].initFade();
+        fade.setTarget(x * UINT16_MAX);
+        fade.setDuration(fade_ms);
+        fade.setEasing(proto::Command::Easing::EASE_IN_OUT);
       } else {
         levels[i].setSet(x * UINT16_MAX);
       }
@@ -66,8 +261,11 @@ int main(int argc, char **argv) {
   }
 
   default:
-    fprintf(stderr, "Usage: %s <channel>{4}\n\tchannel = real | \"x\" real\n", argv[0]);
-    return 1;
+    return usage(argv[0]);
+  }
+
+  if(delay_ms >= 0) {
+    cmd.setExecuteAt(uv_hrtime() + static_cast<uint64_t>(delay_ms) * 1000000);
   }
 
   auto segments = message.getSegmentsForOutput();
@@ -87,58 +285,162 @@ int main(int argc, char **argv) {
   udp.set_broadcast(true);
 
   struct sockaddr_in remoteAddr{};
-  uv_ip4_addr("255.255.255.255", 4242, &remoteAddr);
+  uv_ip4_addr(zone == NO_ZONE ? "255.255.255.255" : zoneGroup4(zone).c_str(), 4242, &remoteAddr);
 
+  // Wait for an answer to a getName, or an acknowledgement
+  const bool query = cmd.isGetName() || cmd.isGetScenes() || sync_clocks;
+  const bool wait = query || ack;
   int rc = 0;
-  send.send(udp, &bufs[0], bufs.size(), reinterpret_cast<struct sockaddr *>(&remoteAddr), [&](int result){
-      if(result < 0) {
-        fprintf(stderr, "failed to send command: %s\n", uv_strerror(result));
-        rc = 1;
-        udp.close();
-        return;
-      }
+  int tries = 0;
+  uv::Timer retry(loop);
+
+  // Each lamp answering a getClock is sent its offset
+  struct OffsetSend {
+    capnp::MallocMessageBuilder message;
+    uv::UDPSend send;
+  };
+  std::list<OffsetSend> offset_sends;
+  uint64_t sent_at = 0;
+  bool sync_over = false;
+
+  bool done = false;
+  auto finish = [&](int result) {
+    if(done) return;  // e.g. a send completing after the answer came in
+    done = true;
+    rc = result;
+    retry.close();
+    udp.close();
+  };
 
-      switch(argc) {
-      case 1:
-        udp.recvStart(static_buffer_alloc_cb, [&](ssize_t result, const uv_buf_t *buf, const struct sockaddr *cAddr, unsigned flags) {
-            (void)flags;
-            if(result < 0) {
-              fprintf(stderr, "failed to read response: %s\n", uv_strerror(result));
-              udp.close();
+  auto sync_clock = [&](proto::Response::Clock::Reader clock, const struct sockaddr *cAddr) {
+    // NTP's estimate, assuming both directions take as long
+    int64_t received_at = uv_hrtime();
+    int64_t offset = ((static_cast<int64_t>(clock.getReceive()) - static_cast<int64_t>(sent_at)) +
+                      (static_cast<int64_t>(clock.getTransmit()) - received_at)) / 2;
+    int64_t round_trip = (received_at - static_cast<int64_t>(sent_at)) -
+                         static_cast<int64_t>(clock.getTransmit() - clock.getReceive());
+    char addr[256];
+    uv_ip6_name(reinterpret_cast<const sockaddr_in6*>(cAddr), addr, sizeof(addr));
+    printf("%s: offset %lld ns, round trip %lld us\n", addr, static_cast<long long>(offset),
+           static_cast<long long>(round_trip / 1000));
+
+    offset_sends.emplace_back();
+    auto sender = std::prev(offset_sends.end());
+    auto offset_cmd = sender->message.initRoot<proto::Command>();
+    offset_cmd.setId(id);
+    offset_cmd.setSetClockOffset(offset);
+    auto segment = sender->message.getSegmentsForOutput()[0];
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(reinterpret_cast<const char*>(segment.begin())),
+                               segment.size() * sizeof(segment[0]));
+    int result = sender->send.send(udp, &buf, 1, cAddr, [&, sender](int result) {
+        if(result < 0) fprintf(stderr, "failed to send clock offset: %s\n", uv_strerror(result));
+        offset_sends.erase(sender);
+        if(sync_over && offset_sends.empty()) finish(0);
+      });
+    if(result < 0) {
+      fprintf(stderr, "failed to send clock offset: %s\n", uv_strerror(result));
+      offset_sends.erase(sender);
+    }
+  };
+
+  std::function<void()> transmit = [&]() {
+    ++tries;
+    sent_at = uv_hrtime();
+    send.send(udp, &bufs[0], bufs.size(), reinterpret_cast<struct sockaddr *>(&remoteAddr), [&](int result){
+        if(result < 0) {
+          fprintf(stderr, "failed to send command: %s\n", uv_strerror(result));
+          finish(1);
+          return;
+        }
+        if(!wait) {
+          finish(0);
+          return;
+        }
+        if(sync_clocks) {
+          retry.start([&]() {
+              sync_over = true;
+              if(offset_sends.empty()) finish(0);
+            }, SYNC_WINDOW);
+          return;
+        }
+        if(query) return;
+        // Acknowledgements of a delayed command come once it's carried out
+        retry.start([&]() {
+            if(tries > RETRIES) {
+              fprintf(stderr, "no acknowledgement after %d tries\n", tries);
+              finish(1);
               return;
             }
-            if(result == 0 && cAddr == nullptr) return;
-            if(result % sizeof(capnp::word)) {
-              fprintf(stderr, "malformed message: size %zu not a multiple of %zu\n", result, sizeof(capnp::word));
-            }
-            capnp::SegmentArrayMessageReader reader({kj::arrayPtr(reinterpret_cast<const capnp::word*>(buf->base),
-                                                                  buf->len/sizeof(capnp::word))});
-            try {
-              auto msg = reader.getRoot<proto::Response>();
-              switch(msg.which()) {
-              case proto::Response::NAME: {
-                char addr[256];
-                uv_ip6_name(reinterpret_cast<const sockaddr_in6*>(cAddr), addr, sizeof(addr));
-                printf("%s - %s\n", msg.getName().cStr(), addr);
-                break;
-              }
+            transmit();
+          }, RETRY_PERIOD + std::chrono::milliseconds(delay_ms > 0 ? delay_ms : 0));
+      });
+  };
+
+  if(wait) {
+    udp.recvStart(static_buffer_alloc_cb, [&](ssize_t result, const uv_buf_t *buf, const struct sockaddr *cAddr, unsigned flags) {
+        (void)flags;
+        if(result < 0) {
+          fprintf(stderr, "failed to read response: %s\n", uv_strerror(result));
+          finish(1);
+          return;
+        }
+        if(result == 0 && cAddr == nullptr) return;
+        if(result % sizeof(capnp::word)) {
+          fprintf(stderr, "malformed message: size %zu not a multiple of %zu\n", result, sizeof(capnp::word));
+        }
+        capnp::SegmentArrayMessageReader reader({kj::arrayPtr(reinterpret_cast<const capnp::word*>(buf->base),
+                                                              buf->len/sizeof(capnp::word))});
+        try {
+          auto msg = reader.getRoot<proto::Response>();
+          if(msg.getId() != id) return;  // a late answer to someone else
+          switch(msg.which()) {
+          case proto::Response::NAME: {
+            char addr[256];
+            uv_ip6_name(reinterpret_cast<const sockaddr_in6*>(cAddr), addr, sizeof(addr));
+            printf("%s - %s\n", msg.getName().cStr(), addr);
+            break;
+          }
 
-              default:
-                puts("unsupported response type");
-                break;
+          case proto::Response::SCENES:
+            for(auto scene : msg.getScenes()) {
+              printf("%s (%u ms):", scene.getName().cStr(), scene.getFade());
+              auto levels = scene.getLevels();
+              for(size_t i = 0; i < levels.size(); ++i) {
+                printf(" %s=%.3f", i < 4 ? channels[i] : "?", static_cast<float>(levels[i]) / UINT16_MAX);
               }
-            } catch(kj::Exception & e) {
-              printf("malformed message: %s\n", e.getDescription().cStr());
+              printf("\n");
             }
-            udp.close();
-          });
-        break;
+            break;
 
-      case 5:
-        udp.close();
-        break;
-      }
-    });
+          case proto::Response::CLOCK:
+            if(!sync_over) sync_clock(msg.getClock(), cAddr);
+            return;  // more lamps may answer
+
+          case proto::Response::ZONE:
+            printf("acknowledged: zone %u\n", msg.getZone());
+            break;
+
+          case proto::Response::POWER:
+            printf("acknowledged:");
+            for(auto power : msg.getPower()) {
+              const char *name = power.getChannel() < 4 ? channels[power.getChannel()] : "?";
+              printf(" %s=%.3f", name, static_cast<float>(power.getValue()) / UINT16_MAX);
+            }
+            printf("\n");
+            break;
+
+          default:
+            puts("unsupported response type");
+            break;
+          }
+        } catch(kj::Exception & e) {
+          printf("malformed message: %s\n", e.getDescription().cStr());
+        }
+        finish(0);
+      });
+  }
+
+  transmit();
   loop.run();
 
   return rc;
@@ -1,31 +1,69 @@
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <vector>
+#include <map>
 #include <memory>
+#include <string>
 
 #include <capnp/serialize.h>
 #include <capnp/serialize-packed.h>
 
 #include "pigpio.h"
 #include "Uv.h"
+#include "ColorFader.h"
+#include "ColorMixer.h"
+#include "DmxInput.h"
+#include "DmxOutput.h"
+#include "Fader.h"
+#include "Pca9685Output.h"
+#include "Persister.h"
+#include "PixelStrip.h"
+#include "PwmOutput.h"
+#include "ResponsePool.h"
+#include "Simulator.h"
+#include "SpiOutput.h"
+#include "Zone.h"
 #include "command.capnp.h"
 #include "state.capnp.h"
 
 using namespace common;
+using namespace ledpi;
 
 namespace {
 
 const char *STATE_PATH = "/var/lib/ledpi-state";
-const char *TMP_STATE_PATH = "/var/lib/ledpi-state.tmp";
+
+constexpr std::chrono::milliseconds FADE_PERIOD(10);
+// Refresh DMA ramps well before they run out
+constexpr std::chrono::milliseconds RAMP_FADE_PERIOD(50);
+// Default shortest time between two applications of SetPower commands
+constexpr std::chrono::milliseconds FRAME_PERIOD(10);
+// Bounds on commands waiting for their executeAt
+constexpr size_t MAX_SCHEDULED = 64;
+constexpr std::chrono::hours MAX_SCHEDULE_AHEAD(1);
+// Journal size past which the state file is rewritten and the journal emptied
+constexpr size_t JOURNAL_LIMIT = 64 * 1024;
 
 struct GPIOGuard {
   ~GPIOGuard() { gpioTerminate(); }
 };
 
+// Room for this many maximum-size datagrams, which libuv then reads with a
+// single recvmmsg
+constexpr size_t RECV_BATCH = 8;
+
+#if UV_VERSION_HEX >= 0x012800
+constexpr unsigned UDP_FLAGS = UV_UDP_RECVMMSG;
+#else
+constexpr unsigned UDP_FLAGS = 0;
+#endif
+
 void static_buffer_alloc_cb(size_t, uv_buf_t * buf) {
-  constexpr size_t length = 64*1024;
+  constexpr size_t length = RECV_BATCH*64*1024;
   static char buffer[length];
   buf->base = buffer;
   buf->len = length;
@@ -33,28 +71,107 @@ void static_buffer_alloc_cb(size_t, uv_buf_t * buf) {
 
 using Power = uint16_t;
 
-void apply(proto::State::Reader state) {
+void update(proto::State::Reader state, Outputs &outputs, const ChannelMask &changed) {
+  for(auto &output : outputs) {
+    output->apply(state, changed);
+  }
+}
+
+void apply(proto::State::Reader state, Outputs &outputs, const ChannelMask &changed) {
   auto levels = state.getLevels();
   auto channels = state.getChannels();
   printf("set:");
   for(size_t i = 0; i < levels.size(); ++i) {
-    printf(" %s=%d", channels[i].getName().cStr(), levels[i]);
-    gpioPWM(channels[i].getGpio(), (static_cast<uint32_t>(UINT16_MAX - levels[i]) * PI_MAX_DUTYCYCLE_RANGE) / UINT16_MAX);
+    if(changed[i]) printf(" %s=%d", channels[i].getName().cStr(), levels[i]);
   }
   printf("\n");
+  update(state, outputs, changed);
 }
 
+void apply(proto::State::Reader state, Outputs &outputs) {
+  apply(state, outputs, ChannelMask(state.getLevels().size(), true));
 }
 
-int main(int, char **) {
-  if(gpioInitialise() < 0) {
-    fprintf(stderr, "GPIO initialization failed\n");
-    return 1;
+// Fill the channel/value list made by init with where each channel touched by
+// a SetPower command ends up, as told by settled
+template<typename Settled, typename Init>
+void settledLevels(Settled settled, proto::State::Reader state,
+                   capnp::List<proto::Command::SetPower>::Reader set_power, Init init) {
+  size_t channels = state.getLevels().size();
+  size_t touched = 0;
+  for(auto instr : set_power) {
+    if(instr.getChannel() < channels) ++touched;
   }
-  GPIOGuard guard;
+
+  auto levels = init(touched);
+  touched = 0;
+  for(auto instr : set_power) {
+    size_t channel = instr.getChannel();
+    if(channel >= channels) continue;
+    levels[touched].setChannel(channel);
+    levels[touched].setValue(settled(channel));
+    ++touched;
+  }
+}
+
+Easing easing(proto::Command::Easing easing) {
+  switch(easing) {
+  case proto::Command::Easing::LINEAR: return Easing::LINEAR;
+  case proto::Command::Easing::EASE_IN: return Easing::EASE_IN;
+  case proto::Command::Easing::EASE_OUT: return Easing::EASE_OUT;
+  case proto::Command::Easing::EASE_IN_OUT: return Easing::EASE_IN_OUT;
+  }
+  return Easing::LINEAR;
+}
+
+}
+
+int main(int argc, char **argv) {
+  bool simulate = false;
+  bool ramp = false;
+  bool double_buffer = false;
+  std::chrono::milliseconds frame_period = FRAME_PERIOD;
+  std::string state_path = STATE_PATH;
+
+  int opt;
+  while((opt = getopt(argc, argv, "srbp:f:")) != -1) {
+    switch(opt) {
+    case 's':
+      simulate = true;
+      break;
+    case 'r':
+      ramp = true;
+      break;
+    case 'b':
+      double_buffer = true;
+      break;
+    case 'p': {
+      char *endptr;
+      long ms = strtol(optarg, &endptr, 10);
+      if(*endptr != '\0' || ms < 0) {
+        fprintf(stderr, "invalid frame period (should be a nonnegative integer of milliseconds): %s\n", optarg);
+        return 1;
+      }
+      frame_period = std::chrono::milliseconds(ms);
+      break;
+    }
+    case 'f':
+      state_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s] [-r] [-b] [-p frame-ms] [-f state-file]\n"
+              "\t-s: simulate GPIO and DMA hardware\n"
+              "\t-r: precompute fades into the DMA ring\n"
+              "\t-b: double-buffer the DMA ring so colour changes never tear\n"
+              "\t-p: apply commands at most once per this many milliseconds (default 10)\n", argv[0]);
+      return 1;
+    }
+  }
+  std::string tmp_state_path = state_path + ".tmp";
+  std::string journal_path = state_path + ".journal";
 
   uv::Loop loop;
-  uv::UDP udp(loop);
+  uv::UDP udp(loop, UDP_FLAGS);
 
   struct sockaddr_in6 addr;
   uv_ip6_addr("::", 4242, &addr);
@@ -63,18 +180,18 @@ int main(int, char **) {
   printf("loading state...");
   fflush(stdout);
 
-  int state_fd = open(STATE_PATH, O_RDONLY);
+  int state_fd = open(state_path.c_str(), O_RDONLY);
   if(state_fd < 0) {
     if(errno == ENOENT) {
-      state_fd = open(TMP_STATE_PATH, O_RDONLY);
+      state_fd = open(tmp_state_path.c_str(), O_RDONLY);
       if(state_fd >= 0) {
-        int res = rename(TMP_STATE_PATH, STATE_PATH);
+        int res = rename(tmp_state_path.c_str(), state_path.c_str());
         if(res >= 0) goto success;
         else close(state_fd);
       }
     }
 
-    fprintf(stderr, "failed to open state file at %s: %s\n", STATE_PATH, strerror(errno));
+    fprintf(stderr, "failed to open state file at %s: %s\n", state_path.c_str(), strerror(errno));
     return 1;
 
   success:
@@ -93,22 +210,214 @@ int main(int, char **) {
 
   auto state = state_builder.getRoot<proto::State>();
 
+  // The strip's DMA memory is set aside when pigpio starts
+  if(simulate) gpioCfgSimulation(1);
+  if(double_buffer) gpioCfgDoubleBuffer(1);
+  if(state.hasStrip()) gpioCfgStrip(PixelStrip::bytes(state.getStrip()));
+  if(gpioInitialise() < 0) {
+    fprintf(stderr, "GPIO initialization failed\n");
+    return 1;
+  }
+  GPIOGuard guard;
+
   if(state.getChannels().size() != state.getLevels().size()) {
     state.initLevels(state.getChannels().size());
   }
 
-  puts(" done");
+  size_t replayed = Persister::replay(journal_path, state);
+
+  printf(" done, %zu journal entries\n", replayed);
+
+  ColorMixer mixer(state.getChannels());
+  mixer.loadTable(state_path + ".lut");
 
-  // Set up PWM outputs
-  for(auto channel : state.getChannels()) {
-    gpioSetPWMrange(channel.getGpio(), PI_MAX_DUTYCYCLE_RANGE);
-    gpioPWM(channel.getGpio(), PI_MAX_DUTYCYCLE_RANGE);
+  Outputs outputs;
+  PwmOutput *pwm_output = new PwmOutput(loop, FADE_PERIOD);
+  outputs.emplace_back(pwm_output);
+  DmxOutput *dmx_output = nullptr;
+  if(state.hasDmxOutput() && state.getDmxOutput().hasDevice()) {
+    dmx_output = new DmxOutput(loop, PwmOutput::RAMP_SPAN);
+    outputs.emplace_back(dmx_output);
+  }
+  SpiOutput *spi_output = nullptr;
+  if(state.hasSpiOutput() && state.getSpiOutput().getChip() != proto::SpiOutput::Chip::NONE) {
+    spi_output = new SpiOutput;
+    outputs.emplace_back(spi_output);
+  }
+  Pca9685Output *pca9685_output = nullptr;
+  if(state.hasPca9685() && state.getPca9685().getAddresses().size() != 0) {
+    pca9685_output = new Pca9685Output;
+    outputs.emplace_back(pca9685_output);
+  }
+  for(auto &output : outputs) {
+    output->setup(state);
+  }
+
+  std::unique_ptr<PixelStrip> strip;
+  if(state.hasStrip() && state.getStrip().getGpio() != 0) {
+    strip.reset(new PixelStrip(loop, state.getStrip()));
   }
 
-  apply(state);
+  std::unique_ptr<Simulator> simulator;
+  if(simulate) {
+    simulator.reset(new Simulator(loop, std::chrono::milliseconds(10)));
+  }
+
+  apply(state, outputs);
+
+  Fader fader(loop, ramp ? RAMP_FADE_PERIOD : FADE_PERIOD,
+              [&](size_t channel, Power level) { state.getLevels().set(channel, level); },
+              [&](const ChannelMask &changed) { update(state, outputs, changed); });
+  if(ramp) {
+    fader.setRamp([&](size_t channel, Power from, Power to) {
+        for(auto &output : outputs) {
+          output->ramp(state, channel, from, to);
+        }
+      }, PwmOutput::RAMP_SPAN);
+  }
+
+  ColorFader color_fader(loop, FADE_PERIOD, mixer, [&](const std::vector<Power> &levels) {
+      ChannelMask changed(levels.size());
+      for(size_t i = 0; i < levels.size(); ++i) {
+        if(!mixer.mixable(i)) continue;
+        state.getLevels().set(i, levels[i]);
+        changed[i] = true;
+      }
+      update(state, outputs, changed);
+    });
+
+  // Level a channel is at, or fading towards
+  auto settled = [&](size_t channel) -> Power {
+    if(color_fader.active() && mixer.mixable(channel)) return color_fader.target()[channel];
+    return fader.active(channel) ? fader.target(channel) : state.getLevels()[channel];
+  };
+
+  Persister persister(loop, [&](capnp::MessageBuilder &snapshot) {
+      snapshot.setRoot(state.asReader());
+      // Fades in progress are journalled by their targets
+      auto levels = snapshot.getRoot<proto::State>().getLevels();
+      for(size_t i = 0; i < levels.size(); ++i) {
+        levels.set(i, settled(i));
+      }
+    }, state_path, tmp_state_path, journal_path, JOURNAL_LIMIT);
+
+  std::unique_ptr<ResponsePool> responses(new ResponsePool);
+
+  auto set_zone_membership = [&](uint16_t zone, uv_membership membership) {
+    if(zone == NO_ZONE) return;
+    for(const auto &group : {zoneGroup4(zone), zoneGroup6(zone)}) {
+      int result = udp.set_membership(group.c_str(), nullptr, membership);
+      if(result < 0) {
+        fprintf(stderr, "failed to %s multicast group %s: %s\n", membership == UV_JOIN_GROUP ? "join" : "leave",
+                group.c_str(), uv_strerror(result));
+      }
+    }
+  };
+  set_zone_membership(state.getZone(), UV_JOIN_GROUP);
+
+  // SetPower commands only update the state and mark their channels dirty. The
+  // outputs and the journal see everything received since the last frame as one
+  // change: right after the loop iteration that read it, or when the frame
+  // period has passed since the last flush, whichever is later. Intermediate
+  // levels are never written to the hardware. DMX input marks its channels live
+  // instead: they go out with the frame but aren't journalled, as the console
+  // sends them again many times a second.
+  uv::Check batch(loop);
+  uv::Timer frame(loop);
+  ChannelMask dirty(state.getLevels().size());
+  ChannelMask live(state.getLevels().size());
+  bool flush_pending = false;
+  auto last_flush = loop.now() - frame_period;
+  auto flush = [&]() {
+    batch.stop();
+    frame.stop();
+    flush_pending = false;
+    if(strip) strip->show();
+    size_t touched = 0;
+    bool changed = false;
+    for(size_t channel = 0; channel < dirty.size(); ++channel) {
+      touched += dirty[channel];
+      if(dirty[channel]) live[channel] = true;
+      changed |= live[channel];
+    }
+    if(!changed) return;
+
+    last_flush = loop.now();
+    apply(state, outputs, live);
+    live.assign(live.size(), false);
+    if(touched == 0) return;
+
+    capnp::MallocMessageBuilder entry_builder;
+    auto levels = entry_builder.initRoot<proto::JournalEntry>().initLevels(touched);
+    size_t i = 0;
+    for(size_t channel = 0; channel < dirty.size(); ++channel) {
+      if(!dirty[channel]) continue;
+      dirty[channel] = false;
+      levels[i].setChannel(channel);
+      levels[i].setValue(settled(channel));
+      ++i;
+    }
+    persister.record(entry_builder);
+  };
+  auto schedule_flush = [&]() {
+    if(flush_pending) return;
+    flush_pending = true;
+    auto next = last_flush + frame_period;
+    if(next <= loop.now()) {
+      batch.start(flush);
+    } else {
+      frame.start(flush, next - loop.now());
+    }
+  };
+
+  // Levels from a lighting console. Each frame cuts the channels whose slot
+  // changed over to it, so whichever of the console and commands moved a
+  // channel last has it.
+  std::unique_ptr<DmxInput> dmx;
+  if(state.hasDmx() && state.asReader().getDmx().getAddress() != 0) {
+    auto patch = state.asReader().getDmx();
+    size_t first = patch.getAddress() - 1;
+    size_t width = patch.getWide() ? 2 : 1;
+    dmx.reset(new DmxInput(loop, patch, [&, first, width](const uint8_t *slots, size_t count) {
+      auto levels = state.getLevels();
+      bool changed = false;
+      for(size_t channel = 0; channel < levels.size(); ++channel) {
+        size_t slot = first + channel * width;
+        if(slot + width > count) break;
+        Power level = width == 2 ? slots[slot] << 8 | slots[slot + 1] : slots[slot] * 257;
+        bool mixing = color_fader.active() && mixer.mixable(channel);
+        if(level == levels[channel] && !fader.active(channel) && !mixing) continue;
+        if(mixing) color_fader.cancel();
+        fader.cancel(channel);
+        levels.set(channel, level);
+        live[channel] = true;
+        changed = true;
+      }
+      if(changed) schedule_flush();
+    }));
+  }
+
+  // Fires for the next command with an executeAt, queued below
+  uv::Timer scheduled_timer(loop);
 
   auto shutdown_cb = [&](int){
     udp.close();
+    if(dmx) dmx->close();
+    batch.close();
+    frame.close();
+    scheduled_timer.close();
+    fader.close();
+    color_fader.close();
+    persister.close();
+
+    // What went out last, before shutting off overwrites it
+    if(simulator) {
+      if(strip) simulator->reportStrip(strip->frame());
+      if(spi_output) simulator->reportSpi(spi_output->frame(), spi_output->applies());
+      if(pca9685_output) {
+        simulator->reportPca9685(pca9685_output->bus(), pca9685_output->addresses(), pca9685_output->applies());
+      }
+    }
 
     // Shut off LEDs
     auto levels = state.getLevels();
@@ -117,10 +426,25 @@ int main(int, char **) {
       old_levels[i] = levels[i];
       levels.set(i, 0);
     }
-    apply(state);
+    apply(state, outputs);
     for(size_t i = 0; i < levels.size(); ++i) {
       levels.set(i, old_levels[i]);
     }
+    pwm_output->close();
+    if(dmx_output) dmx_output->close();
+    if(spi_output) spi_output->close();
+    if(pca9685_output) pca9685_output->close();
+    if(strip) strip->close();
+
+    if(simulator) {
+      auto channels = state.getChannels();
+      printf("simulated %llu pulses, gpio duty:", static_cast<unsigned long long>(simulator->pulses()));
+      for(auto channel : channels) {
+        printf(" %s=%.4f", channel.getName().cStr(), simulator->duty(channel.getGpio()));
+      }
+      printf("\n");
+      simulator->close();
+    }
   };
 
   uv::Signal sigint(loop, shutdown_cb, SIGINT);
@@ -128,6 +452,350 @@ int main(int, char **) {
   uv::Signal sigterm(loop, shutdown_cb, SIGTERM);
   sigterm.unref();
 
+  // How far the lamp's clock, uv_hrtime, is ahead of the controller's, which
+  // executeAt is in. Clocks restart on reboot, so it isn't persisted.
+  int64_t clock_offset = 0;
+
+  // Commands waiting for their executeAt, by when in the lamp's clock
+  struct Scheduled {
+    uint32_t id;
+    std::unique_ptr<capnp::MallocMessageBuilder> command;
+    struct sockaddr_storage addr;
+  };
+  std::multimap<uv::HRClock::time_point, Scheduled> scheduled;
+
+  // Cut or ease a channel over to level, for the next flush
+  auto move_to = [&](size_t channel, Power level, std::chrono::milliseconds fade) {
+    dirty[channel] = true;
+    if(mixer.mixable(channel)) color_fader.cancel();
+    if(fade.count() > 0) {
+      fader.start(channel, state.getLevels()[channel], level, fade, Easing::EASE_IN_OUT);
+    } else {
+      fader.cancel(channel);
+      state.getLevels().set(channel, level);
+    }
+  };
+
+  // Power every channel is at or fading to
+  auto all_settled = [&](proto::Response::Builder response) {
+    auto power = response.initPower(state.getLevels().size());
+    for(size_t i = 0; i < power.size(); ++i) {
+      power[i].setChannel(i);
+      power[i].setValue(settled(i));
+    }
+  };
+
+  // Carry out a command, answering to cAddr
+  auto execute = [&](proto::Command::Reader msg, const struct sockaddr *cAddr) {
+    auto reply = [&](auto fill) {
+      auto slot = responses->acquire();
+      if(!slot) return;
+      auto response = slot->message().initRoot<proto::Response>();
+      response.setId(msg.getId());
+      try {
+        fill(response);
+      } catch(...) {
+        // Or the slot is gone from the pool for good
+        responses->release(slot);
+        throw;
+      }
+      responses->send(slot, udp, cAddr);
+    };
+
+    switch(msg.which()) {
+    case proto::Command::SET_POWER: {
+      auto set_power = msg.getSetPower();
+      for(auto instr : set_power) {
+        size_t channel = instr.getChannel();
+        if(channel >= state.getLevels().size()) {
+          printf("message attempted to modify nonexistent channel %zu\n", channel);
+          continue;
+        }
+        dirty[channel] = true;
+        if(mixer.mixable(channel)) color_fader.cancel();
+        switch(instr.which()) {
+        case proto::Command::SetPower::SET:
+          fader.cancel(channel);
+          state.getLevels().set(channel, instr.getSet());
+          break;
+        case proto::Command::SetPower::MULTIPLY:
+          fader.cancel(channel);
+          state.getLevels().set(channel, state.getLevels()[channel] * instr.getMultiply());
+          break;
+        case proto::Command::SetPower::FADE: {
+          auto fade = instr.getFade();
+          fader.start(channel, state.getLevels()[channel], fade.getTarget(),
+                      std::chrono::milliseconds(fade.getDuration()), easing(fade.getEasing()));
+          break;
+        }
+        }
+      }
+      schedule_flush();
+
+      if(msg.getAck()) {
+        reply([&](proto::Response::Builder response) {
+            settledLevels(settled, state, set_power, [&](size_t n) { return response.initPower(n); });
+          });
+      }
+      break;
+    }
+
+    case proto::Command::GET_POWER:
+      reply([&](proto::Response::Builder response) {
+          auto levels = state.getLevels();
+          auto power = response.initPower(levels.size());
+          for(size_t i = 0; i < levels.size(); ++i) {
+            power[i].setChannel(i);
+            power[i].setValue(levels[i]);
+          }
+        });
+      break;
+
+    case proto::Command::SET_NAME: {
+      state.setName(msg.getSetName());
+      capnp::MallocMessageBuilder entry_builder;
+      entry_builder.initRoot<proto::JournalEntry>().setName(msg.getSetName());
+      persister.record(entry_builder);
+
+      if(msg.getAck()) {
+        reply([&](proto::Response::Builder response) { response.setName(state.getName()); });
+      }
+      break;
+    }
+
+    case proto::Command::GET_NAME:
+      reply([&](proto::Response::Builder response) { response.setName(state.getName()); });
+      break;
+
+    case proto::Command::GET_CHANNELS:
+      reply([&](proto::Response::Builder response) { response.setChannels(state.getChannels()); });
+      break;
+
+    case proto::Command::SET_ZONE: {
+      uint16_t zone = msg.getSetZone();
+      if(zone != state.getZone()) {
+        set_zone_membership(state.getZone(), UV_LEAVE_GROUP);
+        state.setZone(zone);
+        set_zone_membership(zone, UV_JOIN_GROUP);
+        capnp::MallocMessageBuilder entry_builder;
+        entry_builder.initRoot<proto::JournalEntry>().setZone(zone);
+        persister.record(entry_builder);
+      }
+
+      if(msg.getAck()) {
+        reply([&](proto::Response::Builder response) { response.setZone(state.getZone()); });
+      }
+      break;
+    }
+
+    case proto::Command::GET_ZONE:
+      reply([&](proto::Response::Builder response) { response.setZone(state.getZone()); });
+      break;
+
+    case proto::Command::SAVE_SCENE: {
+      auto save = msg.getSaveScene();
+      auto levels = state.getLevels();
+      capnp::MallocMessageBuilder entry_builder;
+      auto entry = entry_builder.initRoot<proto::JournalEntry>();
+      auto scene = entry.initScene();
+      scene.setName(save.getName());
+      scene.setFade(save.getFade());
+      auto scene_levels = scene.initLevels(levels.size());
+      for(size_t i = 0; i < levels.size(); ++i) {
+        scene_levels.set(i, settled(i));
+      }
+      Persister::apply(entry.asReader(), state);
+      persister.record(entry_builder);
+
+      if(msg.getAck()) {
+        reply([&](proto::Response::Builder response) {
+            response.initScenes(1).setWithCaveats(0, scene.asReader());
+          });
+      }
+      break;
+    }
+
+    case proto::Command::RECALL_SCENE: {
+      auto name = msg.getRecallScene();
+      auto levels = state.getLevels();
+      bool found = false;
+      for(auto scene : state.asReader().getScenes()) {
+        if(scene.getName() != name) continue;
+        found = true;
+        auto scene_levels = scene.getLevels();
+        std::chrono::milliseconds fade(scene.getFade());
+        for(size_t channel = 0; channel < scene_levels.size() && channel < levels.size(); ++channel) {
+          move_to(channel, scene_levels[channel], fade);
+        }
+        break;
+      }
+      if(!found) {
+        printf("message attempted to recall nonexistent scene %s\n", name.cStr());
+        break;
+      }
+      schedule_flush();
+
+      if(msg.getAck()) {
+        reply(all_settled);
+      }
+      break;
+    }
+
+    case proto::Command::SET_COLOR: {
+      auto color = msg.getSetColor();
+      // Clamping lets NaN through, to index the color table with
+      bool finite = std::isfinite(color.getIntensity()) &&
+          (color.isTemperature() ? std::isfinite(color.getTemperature())
+                                 : std::isfinite(color.getChromaticity().getX()) &&
+                                   std::isfinite(color.getChromaticity().getY()));
+      if(!finite) {
+        printf("message attempted to set a color that isn't a number\n");
+        break;
+      }
+      double x, y;
+      if(color.isTemperature()) {
+        ColorMixer::planckian(color.getTemperature(), &x, &y);
+      } else {
+        x = color.getChromaticity().getX();
+        y = color.getChromaticity().getY();
+      }
+      if(mixer.mixableCount() == 0) {
+        printf("message attempted to set a color, but no channel has spectra\n");
+        break;
+      }
+      std::chrono::milliseconds fade(color.getFade());
+      if(fade.count() > 0) {
+        auto levels = state.getLevels();
+        std::vector<Power> current(levels.begin(), levels.end());
+        ColorFader::Color from, to{x, y, color.getIntensity()};
+        mixer.measure(current, &from.x, &from.y, &from.intensity);
+        for(size_t channel = 0; channel < current.size(); ++channel) {
+          if(!mixer.mixable(channel)) continue;
+          fader.cancel(channel);
+          dirty[channel] = true;
+        }
+        color_fader.start(from, to, fade, Easing::EASE_IN_OUT);
+      } else {
+        auto mix = mixer.lookup(x, y, color.getIntensity());
+        for(size_t channel = 0; channel < mix.size(); ++channel) {
+          if(mixer.mixable(channel)) move_to(channel, mix[channel], fade);
+        }
+      }
+      schedule_flush();
+
+      if(msg.getAck()) {
+        reply(all_settled);
+      }
+      break;
+    }
+
+    case proto::Command::SET_PIXELS: {
+      if(!strip) {
+        printf("message attempted to set pixels, but there is no strip\n");
+        break;
+      }
+      auto set_pixels = msg.getSetPixels();
+      auto pixels = set_pixels.getPixels();
+      strip->set(set_pixels.getFirst(), pixels.begin(), pixels.size());
+      schedule_flush();
+      break;
+    }
+
+    case proto::Command::GET_SCENES:
+      reply([&](proto::Response::Builder response) { response.setScenes(state.getScenes()); });
+      break;
+
+    case proto::Command::GET_CLOCK: {
+      uint64_t receive = uv_hrtime();
+      reply([&](proto::Response::Builder response) {
+          auto clock = response.initClock();
+          clock.setReceive(receive);
+          clock.setTransmit(uv_hrtime());
+        });
+      break;
+    }
+
+    case proto::Command::SET_CLOCK_OFFSET:
+      clock_offset = msg.getSetClockOffset();
+      printf("clock offset: %lld ns\n", static_cast<long long>(clock_offset));
+      break;
+
+    default:
+      puts("unsupported command");
+      break;
+    }
+  };
+
+  std::function<void()> run_scheduled;
+  auto arm_scheduled = [&]() {
+    if(scheduled.empty()) {
+      scheduled_timer.stop();
+      return;
+    }
+    auto now = uv::HRClock().now();
+    auto when = scheduled.begin()->first;
+    // Round up, as the timer only has millisecond resolution
+    auto wait = when > now ? std::chrono::duration_cast<std::chrono::milliseconds>(
+        when - now + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)) : std::chrono::milliseconds(0);
+    scheduled_timer.start([&]() { run_scheduled(); }, wait);
+  };
+  run_scheduled = [&]() {
+    auto due = uv::HRClock().now();
+    while(!scheduled.empty() && scheduled.begin()->first <= due) {
+      auto entry = std::move(scheduled.begin()->second);
+      scheduled.erase(scheduled.begin());
+      try {
+        execute(entry.command->getRoot<proto::Command>().asReader(), reinterpret_cast<struct sockaddr *>(&entry.addr));
+      } catch(kj::Exception & e) {
+        printf("malformed message: %s\n", e.getDescription().cStr());
+      }
+    }
+    // Lamps only switch together if timed changes skip the frame period
+    if(flush_pending) flush();
+    arm_scheduled();
+  };
+
+  // Queue a command with an executeAt, or carry it out if that's past
+  auto schedule = [&](proto::Command::Reader msg, const struct sockaddr *cAddr) {
+    auto now = uv::HRClock().now();
+    int64_t local = static_cast<int64_t>(msg.getExecuteAt()) + clock_offset;
+    if(local <= static_cast<int64_t>(now.time_since_epoch().count())) {
+      execute(msg, cAddr);
+      if(flush_pending) flush();
+      return;
+    }
+    uv::HRClock::time_point when{uv::HRClock::duration(local)};
+    if(when - now > MAX_SCHEDULE_AHEAD) {
+      printf("message scheduled too far ahead, in %lld s\n",
+             static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(when - now).count()));
+      return;
+    }
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, cAddr, cAddr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    // Ids are optional, and only tell a resend apart from the same client
+    if(msg.getId() != 0) {
+      for(const auto &entry : scheduled) {
+        if(entry.second.id == msg.getId() && memcmp(&entry.second.addr, &addr, sizeof(addr)) == 0) {
+          printf("message %u already scheduled, dropping the resend\n", msg.getId());
+          return;
+        }
+      }
+    }
+    if(scheduled.size() >= MAX_SCHEDULED) {
+      printf("too many scheduled messages, dropping one\n");
+      return;
+    }
+
+    Scheduled entry;
+    entry.id = msg.getId();
+    entry.command.reset(new capnp::MallocMessageBuilder);
+    entry.command->setRoot(msg);
+    entry.addr = addr;
+    scheduled.emplace(when, std::move(entry));
+    arm_scheduled();
+  };
+
   udp.recvStart(static_buffer_alloc_cb, [&](ssize_t result, const uv_buf_t *buf, const struct sockaddr *cAddr, unsigned flags) {
       (void)flags;
       if(result < 0) {
@@ -144,59 +812,14 @@ int main(int, char **) {
       }
 
       capnp::SegmentArrayMessageReader reader({kj::arrayPtr(reinterpret_cast<const capnp::word*>(buf->base),
-                                                            buf->len/sizeof(capnp::word))});
+                                                            result/sizeof(capnp::word))});
 
       try {
         auto msg = reader.getRoot<proto::Command>();
-        switch(msg.which()) {
-        case proto::Command::SET_POWER:
-          for(auto instr : msg.getSetPower()) {
-            size_t channel = instr.getChannel();
-            if(channel > 4) {
-              printf("message attempted to modify nonexistent channel %zu\n", channel);
-              continue;
-            }
-            switch(instr.which()) {
-            case proto::Command::SetPower::SET:
-              state.getLevels().set(channel, instr.getSet());
-              break;
-            case proto::Command::SetPower::MULTIPLY:
-              state.getLevels().set(channel, state.getLevels()[channel] * instr.getMultiply());
-              break;
-            }
-          }
-          apply(state);
-          break;
-
-        case proto::Command::SET_NAME:
-          state.setName(msg.getSetName());
-          break;
-
-        case proto::Command::GET_NAME: {
-          auto response_builder = std::make_shared<capnp::MallocMessageBuilder>();
-          auto response_msg = response_builder->initRoot<proto::Response>();
-          response_msg.setName(state.getName().asString());
-
-          auto send_req = std::make_shared<uv::UDPSend>();
-          auto segs = response_builder->getSegmentsForOutput();
-          std::vector<uv_buf_t> bufs(segs.size());
-          for(size_t i = 0; i < segs.size(); ++i) {
-            bufs[i].base = const_cast<char*>(reinterpret_cast<const char*>(segs[i].begin()));
-            bufs[i].len = sizeof(segs[i]) * segs[i].size();
-          }
-          send_req->send(udp, &bufs[0], bufs.size(), cAddr,
-                         [response_builder, send_req](int result) {
-                           if(result < 0) {
-                             fprintf(stderr, "error sending response: %s\n", uv_strerror(result));
-                           }
-                         });
-
-          break;
-        }
-
-        default:
-          puts("unsupported command");
-          break;
+        if(msg.getExecuteAt() != 0) {
+          schedule(msg, cAddr);
+        } else {
+          execute(msg, cAddr);
         }
       } catch(kj::Exception & e) {
         printf("malformed message: %s\n", e.getDescription().cStr());
@@ -214,18 +837,6 @@ int main(int, char **) {
   // Save state
   printf("saving state...");
   fflush(stdout);
-  state_fd = open(TMP_STATE_PATH, O_WRONLY | O_CREAT);
-  if(state_fd < 0) {
-    fprintf(stderr, "failed to open state file at %s: %s\n", TMP_STATE_PATH, strerror(errno));
-    return 1;
-  }
-  capnp::writePackedMessageToFd(state_fd, state_builder);
-  fsync(state_fd);
-  close(state_fd);
-  int res = rename(TMP_STATE_PATH, STATE_PATH);
-  if(res < 0) {
-    fprintf(stderr, "failed to store state file to %s: %s\n", STATE_PATH, strerror(errno));
-    return 1;
-  }
+  if(!persister.save()) return 1;
   puts(" done");
 }
@@ -701,11 +701,24 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define DMAO_PAGES (PAGES_PER_BLOCK * PI_WAVE_BLOCKS)
 
+#define DMA_BLOCKS (bufferBlocks + PI_WAVE_BLOCKS + shadowBlocks + stripBlocks)
+
 #define NUM_WAVE_OOL (DMAO_PAGES * OOL_PER_OPAGE)
 #define NUM_WAVE_CBS (DMAO_PAGES * CBS_PER_OPAGE)
 
 #define TICKSLOTS 50
 
+#define SIM_BUS_BASE 0x40000000
+
+/* pixel strip: each data bit is 3 serialiser bits, 100 or 110, at 2.4MHz
+   from the 19.2MHz oscillator, then 300us low to latch the pixels */
+
+#define STRIP_BITS_PER_BIT   3
+#define STRIP_RESET_BITS     720
+#define STRIP_CLK_DIVI       8
+#define STRIP_PWM_DREQ       5
+#define STRIP_WORDS_PER_PAGE (PAGE_SIZE/4)
+
 #define PI_I2C_CLOSED 0
 #define PI_I2C_OPENED 1
 
@@ -911,6 +924,7 @@ typedef struct
 {
    uint16_t state;
    int16_t  fd;
+   uint32_t bus;
    uint32_t addr;
    uint32_t flags;
    uint32_t funcs;
@@ -964,6 +978,9 @@ typedef struct
       0-3: dbgLevel
       4-7: alertFreq
       */
+   unsigned simulate;
+   unsigned doubleBuffer;
+   unsigned stripBytes;
 } gpioCfg_t;
 
 typedef struct
@@ -1145,9 +1162,38 @@ static dmaPage_t * * dmaBus = MAP_FAILED;
 static dmaIPage_t * * dmaIVirt = MAP_FAILED;
 static dmaIPage_t * * dmaIBus = MAP_FAILED;
 
+/* second copy of the input pages, see gpioCfgDoubleBuffer */
+
+static dmaIPage_t * * dmaSVirt = MAP_FAILED;
+static dmaIPage_t * * dmaSBus = MAP_FAILED;
+
 static dmaOPage_t * * dmaOVirt = MAP_FAILED;
 static dmaOPage_t * * dmaOBus = MAP_FAILED;
 
+/* two pixel strip frames, see gpioStripOpen, each a page of control
+   blocks followed by its bitstream */
+
+static dmaPage_t * * stripVirt = MAP_FAILED;
+static dmaPage_t * * stripBus = MAP_FAILED;
+static unsigned stripDataPages; /* bitstream pages per frame */
+static unsigned stripBack;      /* frame gpioStripWrite encodes into */
+static int stripPending;        /* the back frame is waiting to be shown */
+static int stripGpio = -1;
+
+/* the last transfer on the simulated SPI bus, see gpioSimSpiRead */
+
+static char spiSimBuf[PI_MAX_SPI_DEVICE_COUNT];
+static unsigned spiSimCount;
+static unsigned spiSimTransfers; /* since gpioSimSpiRead was last called */
+
+/* the simulated I2C slaves, a register file at every address, and the
+   traffic on each bus since gpioSimI2cTraffic was last called */
+
+static uint8_t  i2cSimReg[PI_NUM_I2C_BUS][PI_MAX_I2C_ADDR+1][256];
+static uint8_t  i2cSimPtr[PI_NUM_I2C_BUS][PI_MAX_I2C_ADDR+1];
+static unsigned i2cSimTransactions[PI_NUM_I2C_BUS];
+static unsigned i2cSimBytes[PI_NUM_I2C_BUS];
+
 static volatile uint32_t * auxReg  = MAP_FAILED;
 static volatile uint32_t * clkReg  = MAP_FAILED;
 static volatile uint32_t * dmaReg  = MAP_FAILED;
@@ -1159,6 +1205,7 @@ static volatile uint32_t * systReg = MAP_FAILED;
 
 static volatile uint32_t * dmaIn   = MAP_FAILED;
 static volatile uint32_t * dmaOut  = MAP_FAILED;
+static volatile uint32_t * dmaStrip = MAP_FAILED;
 
 static uint32_t hw_clk_freq[3];
 static uint32_t hw_pwm_freq[2];
@@ -1176,13 +1223,42 @@ static volatile gpioCfg_t gpioCfg =
    0, /* dbgLevel */
    0, /* alertFreq */
    0, /* internals */
+   0, /* simulate */
+   0, /* doubleBuffer */
+   0, /* stripBytes */
 };
 
 /* no initialisation required */
 
 static unsigned bufferBlocks; /* number of blocks in buffer */
+static unsigned shadowBlocks; /* number of blocks in shadow buffer */
+static unsigned stripBlocks; /* number of blocks in pixel strip buffers */
 static unsigned bufferCycles; /* number of cycles */
 
+/* per period off positions of gpios with a ramp in the DMA ring */
+
+static uint16_t pwmRampOff[PI_MAX_USER_GPIO+1][SUPERCYCLE];
+static uint8_t  pwmRamped [PI_MAX_USER_GPIO+1];
+
+/* bits to set and clear per slot, gathered by gpioPWMMulti */
+
+static uint32_t pwmMultiOffSet[SUPERLEVEL+1];
+static uint32_t pwmMultiOffClr[SUPERLEVEL+1];
+static uint16_t pwmMultiOffPos[SUPERLEVEL+1];
+static uint32_t pwmMultiOnSet [SUPERCYCLE];
+static uint32_t pwmMultiOnClr [SUPERCYCLE];
+static uint16_t pwmMultiOnPos [SUPERCYCLE];
+static int      pwmMultiOffCount;
+static int      pwmMultiOnCount;
+
+/* a frame staged in the shadow ring, caught up by dmaFlushFrame */
+
+static int      frameQueued;
+static int      frameRing;    /* ring the DMA engine was running */
+static int      frameLinkCb;  /* its cb relinked into the other ring */
+static int      frameStopPos; /* off slot clearing the stopped gpios */
+static uint32_t frameStopped;
+
 static uint32_t spi_dummy;
 
 static unsigned old_mode_ce0;
@@ -1300,6 +1376,9 @@ static void initHWClk
    (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH);
 
 static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr);
+static void dmaFlushFrame(void);
+static unsigned stripWords(unsigned bytes);
+static void stopHardwarePWM(void);
 
 int gpioWaveTxStart(unsigned wave_mode); /* deprecated */
 
@@ -1349,20 +1428,167 @@ static char *myBuf2Str(unsigned count, char *buf)
 
 /* ----------------------------------------------------------------------- */
 
+static int mySimI2cSegs(unsigned bus, pi_i2c_msg_t *segs, unsigned numSegs)
+{
+   unsigned s, i;
+   uint8_t *reg, *ptr;
+
+   /* one transaction, each segment after a (repeated) start.  A write
+      sets the slave's register pointer from its first byte and stores
+      the rest from there on, a read returns registers from there on */
+
+   for (s=0; s<numSegs; s++)
+   {
+      if (segs[s].addr > PI_MAX_I2C_ADDR) return -1;
+
+      reg = i2cSimReg[bus][segs[s].addr];
+      ptr = &i2cSimPtr[bus][segs[s].addr];
+
+      if (segs[s].flags & 1)
+      {
+         for (i=0; i<segs[s].len; i++) segs[s].buf[i] = reg[(*ptr)++];
+      }
+      else if (segs[s].len)
+      {
+         *ptr = segs[s].buf[0];
+
+         for (i=1; i<segs[s].len; i++) reg[(*ptr)++] = segs[s].buf[i];
+      }
+
+      i2cSimBytes[bus] += 1 + segs[s].len; /* address byte and data */
+   }
+
+   i2cSimTransactions[bus]++;
+
+   return numSegs;
+}
+
+static int mySimI2cSmbus(
+   unsigned handle, char rw, uint8_t cmd, int size, union my_smbus_data *data)
+{
+   pi_i2c_msg_t segs[2];
+   uint8_t wBuf[PI_I2C_SMBUS_BLOCK_MAX + 3];
+   unsigned wLen, rLen;
+   int status;
+
+   /* the SMBus transactions as the messages an adapter would send */
+
+   wBuf[0] = cmd;
+   wLen = 1;
+   rLen = 0;
+
+   switch (size)
+   {
+      case PI_I2C_SMBUS_QUICK:
+         wLen = 0;
+         break;
+
+      case PI_I2C_SMBUS_BYTE:
+         if (rw == PI_I2C_SMBUS_READ) { wLen = 0; rLen = 1; }
+         break;
+
+      case PI_I2C_SMBUS_BYTE_DATA:
+         if (rw == PI_I2C_SMBUS_READ) rLen = 1;
+         else wBuf[wLen++] = data->byte;
+         break;
+
+      case PI_I2C_SMBUS_WORD_DATA:
+      case PI_I2C_SMBUS_PROC_CALL:
+         if ((rw == PI_I2C_SMBUS_WRITE) || (size == PI_I2C_SMBUS_PROC_CALL))
+         {
+            wBuf[wLen++] = data->word & 0xFF;
+            wBuf[wLen++] = data->word >> 8;
+         }
+         if ((rw == PI_I2C_SMBUS_READ) || (size == PI_I2C_SMBUS_PROC_CALL))
+            rLen = 2;
+         break;
+
+      case PI_I2C_SMBUS_BLOCK_DATA:
+      case PI_I2C_SMBUS_BLOCK_PROC_CALL:
+         if ((rw == PI_I2C_SMBUS_WRITE) ||
+             (size == PI_I2C_SMBUS_BLOCK_PROC_CALL))
+         {
+            memcpy(wBuf + 1, data->block, data->block[0] + 1);
+            wLen += data->block[0] + 1;
+         }
+         if ((rw == PI_I2C_SMBUS_READ) ||
+             (size == PI_I2C_SMBUS_BLOCK_PROC_CALL))
+            rLen = 1 + PI_I2C_SMBUS_BLOCK_MAX;
+         break;
+
+      case PI_I2C_SMBUS_I2C_BLOCK_BROKEN:
+      case PI_I2C_SMBUS_I2C_BLOCK_DATA:
+         if (rw == PI_I2C_SMBUS_READ) rLen = data->block[0];
+         else
+         {
+            memcpy(wBuf + 1, data->block + 1, data->block[0]);
+            wLen += data->block[0];
+         }
+         break;
+
+      default:
+         return -1;
+   }
+
+   segs[0].addr  = i2cInfo[handle].addr;
+   segs[0].flags = 0;
+   segs[0].len   = wLen;
+   segs[0].buf   = wBuf;
+
+   segs[1].addr  = i2cInfo[handle].addr;
+   segs[1].flags = 1;
+   segs[1].len   = rLen;
+
+   switch (size)
+   {
+      case PI_I2C_SMBUS_I2C_BLOCK_BROKEN:
+      case PI_I2C_SMBUS_I2C_BLOCK_DATA:
+         segs[1].buf = data->block + 1;
+         break;
+
+      case PI_I2C_SMBUS_BLOCK_DATA:
+      case PI_I2C_SMBUS_BLOCK_PROC_CALL:
+         segs[1].buf = data->block;
+         break;
+
+      default:
+         segs[1].buf = (uint8_t *)data;
+   }
+
+   if (!rLen)
+      status = mySimI2cSegs(i2cInfo[handle].bus, segs, 1);
+   else if (!wLen)
+      status = mySimI2cSegs(i2cInfo[handle].bus, segs + 1, 1);
+   else
+      status = mySimI2cSegs(i2cInfo[handle].bus, segs, 2);
+
+   /* a block read's first byte is its count */
+
+   if ((status >= 0) && rLen &&
+       ((size == PI_I2C_SMBUS_BLOCK_DATA) ||
+        (size == PI_I2C_SMBUS_BLOCK_PROC_CALL)) &&
+       (data->block[0] > PI_I2C_SMBUS_BLOCK_MAX))
+      return -1;
+
+   return (status < 0) ? status : 0;
+}
+
 static int my_smbus_access(
-   int fd, char rw, uint8_t cmd, int size, union my_smbus_data *data)
+   unsigned handle, char rw, uint8_t cmd, int size, union my_smbus_data *data)
 {
    struct my_smbus_ioctl_data args;
 
    DBG(DBG_INTERNAL, "rw=%d reg=%d cmd=%d data=%s",
       rw, cmd, size, myBuf2Str(data->byte+1, (char*)data));
 
+   if (gpioCfg.simulate) return mySimI2cSmbus(handle, rw, cmd, size, data);
+
    args.read_write = rw;
    args.command    = cmd;
    args.size       = size;
    args.data       = data;
 
-   return ioctl(fd, PI_I2C_SMBUS, &args);
+   return ioctl(i2cInfo[handle].fd, PI_I2C_SMBUS, &args);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1413,22 +1639,40 @@ static void myGpioSleep(int seconds, int micros)
 
 /* ----------------------------------------------------------------------- */
 
+static uint32_t mySystemTick(void)
+{
+   struct timespec ts;
+
+   /* a simulated system timer doesn't count by itself */
+
+   if (gpioCfg.simulate)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+
+      systReg[SYST_CLO] = ((uint32_t)ts.tv_sec * MILLION) + (ts.tv_nsec / THOUSAND);
+   }
+
+   return systReg[SYST_CLO];
+}
+
+/* ----------------------------------------------------------------------- */
+
 static uint32_t myGpioDelay(uint32_t micros)
 {
    uint32_t start;
 
-   start = systReg[SYST_CLO];
+   start = mySystemTick();
 
    if (micros <= PI_MAX_BUSY_DELAY)
    {
-      while ((systReg[SYST_CLO] - start) <= micros);
+      while ((mySystemTick() - start) <= micros);
    }
    else
    {
       myGpioSleep(micros/MILLION, micros%MILLION);
    }
 
-   return (systReg[SYST_CLO] - start);
+   return (mySystemTick() - start);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1527,9 +1771,13 @@ static void mySetGpioOff(unsigned gpio, int pos)
 {
    int page, slot;
 
+   dmaFlushFrame();
+
    myOffPageSlot(pos, &page, &slot);
 
    dmaIVirt[page]->gpioOff[slot] |= (1<<gpio);
+
+   if (shadowBlocks) dmaSVirt[page]->gpioOff[slot] |= (1<<gpio);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1538,9 +1786,13 @@ static void myClearGpioOff(unsigned gpio, int pos)
 {
    int page, slot;
 
+   dmaFlushFrame();
+
    myOffPageSlot(pos, &page, &slot);
 
    dmaIVirt[page]->gpioOff[slot] &= ~(1<<gpio);
+
+   if (shadowBlocks) dmaSVirt[page]->gpioOff[slot] &= ~(1<<gpio);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1549,10 +1801,14 @@ static void mySetGpioOn(unsigned gpio, int pos)
 {
    int page, slot;
 
+   dmaFlushFrame();
+
    page = pos/ON_PER_IPAGE;
    slot = pos%ON_PER_IPAGE;
 
    dmaIVirt[page]->gpioOn[slot] |= (1<<gpio);
+
+   if (shadowBlocks) dmaSVirt[page]->gpioOn[slot] |= (1<<gpio);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1561,10 +1817,83 @@ static void myClearGpioOn(unsigned gpio, int pos)
 {
    int page, slot;
 
+   dmaFlushFrame();
+
    page = pos/ON_PER_IPAGE;
    slot = pos%ON_PER_IPAGE;
 
    dmaIVirt[page]->gpioOn[slot] &= ~(1<<gpio);
+
+   if (shadowBlocks) dmaSVirt[page]->gpioOn[slot] &= ~(1<<gpio);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myGpioSetPwmPeriod(unsigned gpio, int period, int newOff)
+{
+   int oldOff, realRange, cycles;
+
+   realRange = pwmRealRange[gpioInfo[gpio].freqIdx];
+
+   cycles    = pwmCycles   [gpioInfo[gpio].freqIdx];
+
+   oldOff = pwmRampOff[gpio][period];
+
+   if (newOff != oldOff)
+   {
+      if (newOff) mySetGpioOff(gpio, (period*realRange)+newOff);
+
+      if (oldOff) myClearGpioOff(gpio, (period*realRange)+oldOff);
+
+      if      (newOff && !oldOff) mySetGpioOn  (gpio, period*cycles);
+      else if (!newOff && oldOff) myClearGpioOn(gpio, period*cycles);
+
+      pwmRampOff[gpio][period] = newOff;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myGpioBeginRamp(unsigned gpio)
+{
+   int off, periods, i;
+
+   if (pwmRamped[gpio]) return;
+
+   /* every period starts out at the steady dutycycle */
+
+   off = (gpioInfo[gpio].width * pwmRealRange[gpioInfo[gpio].freqIdx]) /
+      gpioInfo[gpio].range;
+
+   periods = SUPERCYCLE / pwmCycles[gpioInfo[gpio].freqIdx];
+
+   for (i=0; i<periods; i++) pwmRampOff[gpio][i] = off;
+
+   pwmRamped[gpio] = 1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myGpioEndRamp(unsigned gpio, int newVal)
+{
+   int newOff, periods, i;
+
+   DBG(DBG_INTERNAL, "myGpioEndRamp %d to %d", gpio, newVal);
+
+   newOff = (newVal * pwmRealRange[gpioInfo[gpio].freqIdx]) /
+      gpioInfo[gpio].range;
+
+   periods = SUPERCYCLE / pwmCycles[gpioInfo[gpio].freqIdx];
+
+   for (i=0; i<periods; i++) myGpioSetPwmPeriod(gpio, i, newOff);
+
+   pwmRamped[gpio] = 0;
+
+   if (!newOff)
+   {
+      *(gpioReg + GPCLR0) = (1<<gpio);
+      *(gpioReg + GPCLR0) = (1<<gpio);
+   }
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1577,6 +1906,14 @@ static void myGpioSetPwm(unsigned gpio, int oldVal, int newVal)
    DBG(DBG_INTERNAL,
       "myGpioSetPwm %d from %d to %d", gpio, oldVal, newVal);
 
+   if (pwmRamped[gpio])
+   {
+      /* the periods no longer share an off position */
+
+      myGpioEndRamp(gpio, newVal);
+      return;
+   }
+
    switchGpioOff = 0;
 
    realRange = pwmRealRange[gpioInfo[gpio].freqIdx];
@@ -2246,7 +2583,7 @@ int i2cWriteQuick(unsigned handle, unsigned bit)
       SOFT_ERROR(PI_BAD_PARAM, "bad bit (%d)", bit);
 
    status = my_smbus_access(
-      i2cInfo[handle].fd, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
+      handle, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
 
    if (status < 0)
    {
@@ -2276,7 +2613,7 @@ int i2cReadByte(unsigned handle)
       SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
    status = my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
+      handle, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
 
    if (status < 0)
    {
@@ -2309,7 +2646,7 @@ int i2cWriteByte(unsigned handle, unsigned bVal)
       SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
+            handle,
             PI_I2C_SMBUS_WRITE,
             bVal,
             PI_I2C_SMBUS_BYTE,
@@ -2346,7 +2683,7 @@ int i2cReadByteData(unsigned handle, unsigned reg)
    if (reg > 0xFF)
       SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   status = my_smbus_access(i2cInfo[handle].fd,
+   status = my_smbus_access(handle,
             PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
 
    if (status < 0)
@@ -2387,7 +2724,7 @@ int i2cWriteByteData(unsigned handle, unsigned reg, unsigned bVal)
    data.byte = bVal;
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
+            handle,
             PI_I2C_SMBUS_WRITE,
             reg,
             PI_I2C_SMBUS_BYTE_DATA,
@@ -2425,7 +2762,7 @@ int i2cReadWordData(unsigned handle, unsigned reg)
       SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
    status = (my_smbus_access(
-      i2cInfo[handle].fd,
+      handle,
       PI_I2C_SMBUS_READ,
       reg,
       PI_I2C_SMBUS_WORD_DATA,
@@ -2469,7 +2806,7 @@ int i2cWriteWordData(unsigned handle, unsigned reg, unsigned wVal)
    data.word = wVal;
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
+            handle,
             PI_I2C_SMBUS_WRITE,
             reg,
             PI_I2C_SMBUS_WORD_DATA,
@@ -2512,7 +2849,7 @@ int i2cProcessCall(unsigned handle, unsigned reg, unsigned wVal)
    data.word = wVal;
 
    status = (my_smbus_access(
-      i2cInfo[handle].fd,
+      handle,
       PI_I2C_SMBUS_WRITE,
       reg, PI_I2C_SMBUS_PROC_CALL,
       &data));
@@ -2550,7 +2887,7 @@ int i2cReadBlockData(unsigned handle, unsigned reg, char *buf)
       SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
    status = (my_smbus_access(
-      i2cInfo[handle].fd,
+      handle,
       PI_I2C_SMBUS_READ,
       reg,
       PI_I2C_SMBUS_BLOCK_DATA,
@@ -2604,7 +2941,7 @@ int i2cWriteBlockData(
    data.block[0] = count;
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
+            handle,
             PI_I2C_SMBUS_WRITE,
             reg,
             PI_I2C_SMBUS_BLOCK_DATA,
@@ -2651,7 +2988,7 @@ int i2cBlockProcessCall(
    data.block[0] = count;
 
    status = (my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg,
+      handle, PI_I2C_SMBUS_WRITE, reg,
       PI_I2C_SMBUS_BLOCK_PROC_CALL, &data));
 
    if (status < 0)
@@ -2707,7 +3044,7 @@ int i2cReadI2CBlockData(
    data.block[0] = count;
 
    status = (my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, size, &data));
+      handle, PI_I2C_SMBUS_READ, reg, size, &data));
 
    if (status < 0)
    {
@@ -2758,7 +3095,7 @@ int i2cWriteI2CBlockData(
    data.block[0] = count;
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
+            handle,
             PI_I2C_SMBUS_WRITE,
             reg,
             PI_I2C_SMBUS_I2C_BLOCK_BROKEN,
@@ -2776,6 +3113,7 @@ int i2cWriteI2CBlockData(
 int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
 {
    int bytes;
+   pi_i2c_msg_t seg;
 
    DBG(DBG_USER, "handle=%d count=%d [%s]",
       handle, count, myBuf2Str(count, buf));
@@ -2791,6 +3129,19 @@ int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
    if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
       SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
+   if (gpioCfg.simulate)
+   {
+      seg.addr = i2cInfo[handle].addr;
+      seg.flags = 0;
+      seg.len = count;
+      seg.buf = (uint8_t *)buf;
+
+      if (mySimI2cSegs(i2cInfo[handle].bus, &seg, 1) < 0)
+         return PI_I2C_WRITE_FAILED;
+
+      return 0;
+   }
+
    bytes = write(i2cInfo[handle].fd, buf, count);
 
    if (bytes != count)
@@ -2805,6 +3156,7 @@ int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
 int i2cReadDevice(unsigned handle, char *buf, unsigned count)
 {
    int bytes;
+   pi_i2c_msg_t seg;
 
    DBG(DBG_USER, "handle=%d count=%d buf=%08X",
       handle, count, (unsigned)buf);
@@ -2820,6 +3172,19 @@ int i2cReadDevice(unsigned handle, char *buf, unsigned count)
    if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
       SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
+   if (gpioCfg.simulate)
+   {
+      seg.addr = i2cInfo[handle].addr;
+      seg.flags = 1;
+      seg.len = count;
+      seg.buf = (uint8_t *)buf;
+
+      if (mySimI2cSegs(i2cInfo[handle].bus, &seg, 1) < 0)
+         return PI_I2C_READ_FAILED;
+
+      return count;
+   }
+
    bytes = read(i2cInfo[handle].fd, buf, count);
 
    if (bytes != count)
@@ -2866,6 +3231,20 @@ int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags)
    if (slot < 0)
       SOFT_ERROR(PI_NO_HANDLE, "no I2C handles");
 
+   i2cInfo[slot].bus = i2cBus;
+   i2cInfo[slot].addr = i2cAddr;
+   i2cInfo[slot].flags = i2cFlags;
+
+   if (gpioCfg.simulate)
+   {
+      /* every address has a simulated slave, see gpioSimI2cRead */
+
+      i2cInfo[slot].fd = -1;
+      i2cInfo[slot].funcs = -1;
+
+      return slot;
+   }
+
    sprintf(dev, "/dev/i2c-%d", i2cBus);
 
    if ((fd = open(dev, O_RDWR)) < 0)
@@ -2897,8 +3276,6 @@ int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags)
    }
 
    i2cInfo[slot].fd = fd;
-   i2cInfo[slot].addr = i2cAddr;
-   i2cInfo[slot].flags = i2cFlags;
    i2cInfo[slot].funcs = funcs;
 
    return slot;
@@ -2961,6 +3338,14 @@ int i2cSegments(unsigned handle, pi_i2c_msg_t *segs, unsigned numSegs)
    if (numSegs > PI_I2C_RDRW_IOCTL_MAX_MSGS)
       SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
 
+   if (gpioCfg.simulate)
+   {
+      retval = mySimI2cSegs(i2cInfo[handle].bus, segs, numSegs);
+
+      if (retval >= 0) return retval;
+      else             return PI_BAD_I2C_SEG;
+   }
+
    rdwr.msgs = segs;
    rdwr.nmsgs = numSegs;
 
@@ -3377,6 +3762,25 @@ static void spiGoS(
    spiReg[SPI_CS] = spiDefaults; /* stop */
 }
 
+static void spiGoSim(
+   char     *txBuf,
+   char     *rxBuf,
+   unsigned count)
+{
+   /* the simulated bus has MOSI looped back to MISO and remembers
+      what was sent, there being no controller to wait on */
+
+   if (!count) return;
+
+   if (txBuf) memcpy(spiSimBuf, txBuf, count);
+   else       memset(spiSimBuf, 0, count);
+
+   if (rxBuf) memcpy(rxBuf, spiSimBuf, count);
+
+   spiSimCount = count;
+   spiSimTransfers++;
+}
+
 static void spiGo(
    unsigned speed,
    uint32_t flags,
@@ -3384,7 +3788,11 @@ static void spiGo(
    char     *rxBuf,
    unsigned count)
 {
-   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
+   if (gpioCfg.simulate)
+   {
+      spiGoSim(txBuf, rxBuf, count);
+   }
+   else if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
    {
       spiGoA(speed, flags, txBuf, rxBuf, count);
    }
@@ -3665,83 +4073,338 @@ int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count)
 
 /* ======================================================================= */
 
-
-int serOpen(char *tty, unsigned serBaud, unsigned serFlags)
+static uint32_t * stripWordAdr(unsigned frame, unsigned word)
 {
-   struct termios new;
-   int speed;
-   int fd;
-   int i, slot;
+   return (uint32_t *)
+      stripVirt[(frame * (1 + stripDataPages)) + 1 + (word / STRIP_WORDS_PER_PAGE)]
+      + (word % STRIP_WORDS_PER_PAGE);
+}
 
-   DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+static void stripEncode(unsigned frame, char *buf, unsigned count)
+{
+   uint64_t bits;
+   unsigned i, mask, pending, w, words;
 
-   SER_CHECK_INITED;
+   words = stripWords(count);
 
-   if (strncmp("/dev/tty", tty, 8))
-      SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+   bits = 0;
+   pending = 0;
+   w = 0;
 
-   switch (serBaud)
+   for (i=0; i<count; i++)
    {
-      case     50: speed =     B50; break;
-      case     75: speed =     B75; break;
-      case    110: speed =    B110; break;
-      case    134: speed =    B134; break;
-      case    150: speed =    B150; break;
-      case    200: speed =    B200; break;
-      case    300: speed =    B300; break;
-      case    600: speed =    B600; break;
-      case   1200: speed =   B1200; break;
-      case   1800: speed =   B1800; break;
-      case   2400: speed =   B2400; break;
-      case   4800: speed =   B4800; break;
-      case   9600: speed =   B9600; break;
-      case  19200: speed =  B19200; break;
-      case  38400: speed =  B38400; break;
-      case  57600: speed =  B57600; break;
-      case 115200: speed = B115200; break;
-      case 230400: speed = B230400; break;
+      for (mask=0x80; mask; mask>>=1)
+      {
+         bits = (bits << STRIP_BITS_PER_BIT) | ((buf[i] & mask) ? 6 : 4);
+         pending += STRIP_BITS_PER_BIT;
 
-      default:
-         SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+         if (pending >= 32)
+         {
+            pending -= 32;
+            *stripWordAdr(frame, w++) = bits >> pending;
+         }
+      }
    }
 
-   if (serFlags)
-      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+   if (pending) *stripWordAdr(frame, w++) = bits << (32 - pending);
 
-   slot = -1;
+   while (w < words) *stripWordAdr(frame, w++) = 0;
+}
 
-   for (i=0; i<PI_SER_SLOTS; i++)
-   {
-      if (serInfo[i].state == PI_SER_CLOSED)
-      {
-         serInfo[i].state = PI_SER_OPENED;
-         slot = i;
-         break;
-      }
-   }
+static void stripLink(unsigned frame, unsigned count)
+{
+   rawCbs_t * cb;
+   unsigned first, p, pages, words, length;
 
-   if (slot < 0)
-      SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+   first = frame * (1 + stripDataPages);
+   words = stripWords(count);
+   pages = (words + STRIP_WORDS_PER_PAGE - 1) / STRIP_WORDS_PER_PAGE;
 
-   if ((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1)
-   {
-      serInfo[slot].state = PI_SER_CLOSED;
-      return PI_SER_OPEN_FAILED;
-   }
+   /* a control block a page, pages needn't be contiguous in bus memory */
 
-   tcgetattr(fd, &new);
+   for (p=0; p<pages; p++)
+   {
+      length = words - (p * STRIP_WORDS_PER_PAGE);
+      if (length > STRIP_WORDS_PER_PAGE) length = STRIP_WORDS_PER_PAGE;
 
-   cfmakeraw(&new);
+      cb = &stripVirt[first]->cb[p];
 
-   cfsetispeed(&new, speed);
-   cfsetospeed(&new, speed);
+      cb->info   = NORMAL_DMA | TIMED_DMA(STRIP_PWM_DREQ) | DMA_SRC_INC;
+      cb->src    = (uint32_t)(uintptr_t) stripBus[first + 1 + p];
+      cb->dst    = PWM_TIMER;
+      cb->length = length * 4;
+      cb->stride = 0;
 
-   new.c_cc [VMIN]  = 0;
-   new.c_cc [VTIME] = 0;
+      if ((p + 1) < pages)
+         cb->next = (uint32_t)(uintptr_t) &stripBus[first]->cb[p + 1];
+      else
+         cb->next = 0;
+   }
+}
+
+int gpioStripOpen(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.stripBytes)
+      SOFT_ERROR(PI_NO_STRIP, "no strip buffer configured");
+
+   if ((gpio != 12) && (gpio != 18))
+      SOFT_ERROR(PI_BAD_STRIP_GPIO, "bad gpio for pixel strip (%d)", gpio);
+
+   if (gpioCfg.clockPeriph == PI_CLOCK_PWM)
+      SOFT_ERROR(PI_HPWM_ILLEGAL, "illegal, PWM in use for main clock");
+
+   if (gpioCfg.DMAprimaryChannel >= 15)
+      SOFT_ERROR(PI_BAD_PRIM_CHANNEL, "strip DMA channel not mapped");
+
+   /* the PWM peripheral is ours alone */
+
+   if (gpioWaveTxBusy()) gpioWaveTxStop();
+   waveClockInited = 0;
+   stopHardwarePWM();
+
+   dmaStrip = dmaReg + (PI_DEFAULT_DMA_STRIP_CHANNEL * 0x40);
+   dmaStrip[DMA_CS] = DMA_CHANNEL_RESET;
+
+   initHWClk(CLK_PWMCTL, CLK_PWMDIV, CLK_CTL_SRC_OSC, STRIP_CLK_DIVI, 0, 0);
+
+   pwmReg[PWM_CTL] = 0;
+
+   myGpioDelay(10);
+
+   pwmReg[PWM_STA] = -1;
+
+   myGpioDelay(10);
+
+   /* serialise whole fifo words, the line idles low when it runs dry */
+
+   pwmReg[PWM_RNG1] = 32;
+
+   myGpioDelay(10);
+
+   pwmReg[PWM_DMAC] = PWM_DMAC_ENAB      |
+                      PWM_DMAC_PANIC(7)  |
+                      PWM_DMAC_DREQ(3);
+
+   pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
+
+   myGpioDelay(10);
+
+   pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+
+   myGpioSetMode(gpio, (gpio == 12) ? PI_ALT0 : PI_ALT5);
+
+   stripGpio = gpio;
+   stripBack = 0;
+   stripPending = 0;
+
+   return 0;
+}
+
+int gpioStripWrite(char *buf, unsigned count)
+{
+   DBG(DBG_USER, "count=%d", count);
+
+   CHECK_INITED;
+
+   if (stripGpio < 0)
+      SOFT_ERROR(PI_NO_STRIP, "no pixel strip open");
+
+   if ((!count) || (count > gpioCfg.stripBytes))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+   /* the frame being sent, if any, is the other one */
+
+   stripEncode(stripBack, buf, count);
+   stripLink(stripBack, count);
+
+   stripPending = 1;
+
+   return 0;
+}
+
+int gpioStripShow(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (stripGpio < 0)
+      SOFT_ERROR(PI_NO_STRIP, "no pixel strip open");
+
+   if (dmaStrip[DMA_CS] & DMA_ACTIVATE) return PI_STRIP_BUSY;
+
+   if (!stripPending) return 0;
+
+   initDMAgo(dmaStrip,
+      (uint32_t)(uintptr_t) &stripBus[stripBack * (1 + stripDataPages)]->cb[0]);
+
+   /* simulated, it is sent at once (see gpioSimStripRead) */
+
+   if (gpioCfg.simulate) dmaStrip[DMA_CS] = DMA_END_FLAG;
+
+   stripBack ^= 1;
+   stripPending = 0;
+
+   return 0;
+}
+
+int gpioStripClose(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (stripGpio < 0)
+      SOFT_ERROR(PI_NO_STRIP, "no pixel strip open");
+
+   dmaStrip[DMA_CS] = DMA_CHANNEL_RESET;
+
+   pwmReg[PWM_CTL] = 0;
+   pwmReg[PWM_DMAC] = 0;
+
+   myGpioSetMode(stripGpio, PI_INPUT);
+
+   stripGpio = -1;
+
+   return 0;
+}
+
+
+/* ======================================================================= */
+
+
+/* asm/termbits.h's termios2, which can't be included alongside termios.h */
+
+struct mySerTermios2
+{
+   tcflag_t c_iflag;
+   tcflag_t c_oflag;
+   tcflag_t c_cflag;
+   tcflag_t c_lflag;
+   cc_t c_line;
+   cc_t c_cc[19];
+   speed_t c_ispeed;
+   speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+#define MY_TCGETS2 _IOR('T', 0x2A, struct mySerTermios2)
+#define MY_TCSETS2 _IOW('T', 0x2B, struct mySerTermios2)
+
+static int mySerCustomSpeed(int fd, unsigned baud)
+{
+   struct mySerTermios2 t2;
+
+   if (ioctl(fd, MY_TCGETS2, &t2) < 0) return -1;
+
+   t2.c_cflag &= ~CBAUD;
+   t2.c_cflag |= BOTHER;
+   t2.c_ispeed = baud;
+   t2.c_ospeed = baud;
+
+   return ioctl(fd, MY_TCSETS2, &t2);
+}
+
+int serOpen(char *tty, unsigned serBaud, unsigned serFlags)
+{
+   struct termios new;
+   int speed;
+   int custom = 0;
+   int fd;
+   int i, slot;
+
+   DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+
+   SER_CHECK_INITED;
+
+   if (strncmp("/dev/tty", tty, 8))
+      SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+
+   switch (serBaud)
+   {
+      case     50: speed =     B50; break;
+      case     75: speed =     B75; break;
+      case    110: speed =    B110; break;
+      case    134: speed =    B134; break;
+      case    150: speed =    B150; break;
+      case    200: speed =    B200; break;
+      case    300: speed =    B300; break;
+      case    600: speed =    B600; break;
+      case   1200: speed =   B1200; break;
+      case   1800: speed =   B1800; break;
+      case   2400: speed =   B2400; break;
+      case   4800: speed =   B4800; break;
+      case   9600: speed =   B9600; break;
+      case  19200: speed =  B19200; break;
+      case  38400: speed =  B38400; break;
+      case  57600: speed =  B57600; break;
+      case 115200: speed = B115200; break;
+      case 230400: speed = B230400; break;
+
+      default:
+         if ((serBaud < 50) || (serBaud > 4000000))
+            SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+         /* set below through termios2 */
+         speed = B38400;
+         custom = 1;
+   }
+
+   if (serFlags & ~PI_SER_TWO_STOP_BITS)
+      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+
+   slot = -1;
+
+   for (i=0; i<PI_SER_SLOTS; i++)
+   {
+      if (serInfo[i].state == PI_SER_CLOSED)
+      {
+         serInfo[i].state = PI_SER_OPENED;
+         slot = i;
+         break;
+      }
+   }
+
+   if (slot < 0)
+      SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+
+   if ((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1)
+   {
+      serInfo[slot].state = PI_SER_CLOSED;
+      return PI_SER_OPEN_FAILED;
+   }
+
+   tcgetattr(fd, &new);
+
+   cfmakeraw(&new);
+
+   cfsetispeed(&new, speed);
+   cfsetospeed(&new, speed);
+
+   if (serFlags & PI_SER_TWO_STOP_BITS) new.c_cflag |= CSTOPB;
+
+   new.c_cc [VMIN]  = 0;
+   new.c_cc [VTIME] = 0;
 
    tcflush(fd, TCIFLUSH);
    tcsetattr(fd, TCSANOW, &new);
 
+   if (custom)
+   {
+      if (mySerCustomSpeed(fd, serBaud) < 0)
+      {
+         close(fd);
+         serInfo[slot].state = PI_SER_CLOSED;
+         SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+      }
+   }
+
    //fcntl(fd, F_SETFL, O_RDWR);
 
    serInfo[slot].fd = fd;
@@ -3842,6 +4505,38 @@ int serWrite(unsigned handle, char *buf, unsigned count)
       return 0;
 }
 
+int serBreak(unsigned handle, unsigned breakMicros, unsigned markMicros)
+{
+   int fd;
+
+   DBG(DBG_USER, "handle=%d breakMicros=%d markMicros=%d",
+      handle, breakMicros, markMicros);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if ((!breakMicros) || (breakMicros > MILLION) || (markMicros > MILLION))
+      SOFT_ERROR(PI_BAD_PARAM, "bad break (%d) or mark (%d)",
+         breakMicros, markMicros);
+
+   fd = serInfo[handle].fd;
+
+   if (tcdrain(fd) < 0) return PI_SER_WRITE_FAILED;
+
+   if (ioctl(fd, TIOCSBRK) < 0) return PI_SER_WRITE_FAILED;
+   myGpioDelay(breakMicros);
+   if (ioctl(fd, TIOCCBRK) < 0) return PI_SER_WRITE_FAILED;
+
+   if (markMicros) myGpioDelay(markMicros);
+
+   return 0;
+}
+
 int serRead(unsigned handle, char *buf, unsigned count)
 {
    int r;
@@ -4019,6 +4714,72 @@ unsigned rawWaveCB(void)
 
 /* ----------------------------------------------------------------------- */
 
+static dmaIPage_t * * dmaRingVirt(int ring)
+{
+   return ring ? dmaSVirt : dmaIVirt;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static rawCbs_t * dmaRingCb(int ring, int pos)
+{
+   return &dmaRingVirt(ring)[pos/CBS_PER_IPAGE]->cb[pos%CBS_PER_IPAGE];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaRingCbAdr(int ring, int pos)
+{
+   dmaIPage_t * * bus;
+
+   bus = ring ? dmaSBus : dmaIBus;
+
+   return (uint32_t)(uintptr_t) &bus[pos/CBS_PER_IPAGE]->cb[pos%CBS_PER_IPAGE];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int dmaFindCb(uint32_t cbAddr, int * ring)
+{
+   dmaIPage_t * * bus;
+   unsigned page, cb;
+   int r;
+
+   for (r=0; r<=(shadowBlocks?1:0); r++)
+   {
+      bus = r ? dmaSBus : dmaIBus;
+
+      for (page=0; page<DMAI_PAGES; page++)
+      {
+         cb = (cbAddr - (uint32_t)(uintptr_t)bus[page]) / sizeof(rawCbs_t);
+
+         if (cb < CBS_PER_IPAGE)
+         {
+            if (ring) *ring = r;
+
+            return (page*CBS_PER_IPAGE) + cb;
+         }
+      }
+   }
+
+   return -1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int dmaCurrentCycle(void)
+{
+   int cb;
+
+   cb = dmaFindCb(dmaIn[DMA_CONBLK_AD], NULL);
+
+   if (cb < 0) return 0;
+
+   return cb / CBS_PER_CYCLE;
+}
+
+/* ----------------------------------------------------------------------- */
+
 static uint32_t dmaPwmDataAdr(int pos)
 {
    return (uint32_t) &dmaIBus[pos]->periphData;
@@ -4167,18 +4928,12 @@ static void dmaDelayCb(int b)
 
 /* ----------------------------------------------------------------------- */
 
-static void dmaInitCbs(void)
+static void dmaInitRing(void)
 {
    int b, pulse, level, cycle;
 
    rawCbs_t * p;
 
-   /* set up the DMA control blocks */
-
-   DBG(DBG_STARTUP, "");
-
-   gpioStats.dmaInitCbsCount++;
-
    b = -1;
    level = 0;
 
@@ -4211,6 +4966,134 @@ static void dmaInitCbs(void)
    DBG(DBG_STARTUP, "%d control blocks (exp=%d)", b+1, NUM_CBS);
 }
 
+/* ----------------------------------------------------------------------- */
+
+static void dmaInitCbs(void)
+{
+   dmaIPage_t * * virt, * * bus;
+
+   /* set up the DMA control blocks */
+
+   DBG(DBG_STARTUP, "");
+
+   gpioStats.dmaInitCbsCount++;
+
+   dmaInitRing();
+
+   if (shadowBlocks)
+   {
+      /* the shadow ring is laid out just like the live one */
+
+      virt = dmaIVirt;
+      bus  = dmaIBus;
+
+      dmaIVirt = dmaSVirt;
+      dmaIBus  = dmaSBus;
+
+      dmaInitRing();
+
+      dmaIVirt = virt;
+      dmaIBus  = bus;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static volatile uint32_t * mySimBusToVirt(uint32_t adr)
+{
+   uint32_t off, page;
+
+   if ((adr & 0xFF000000) == PI_PERI_BUS)
+   {
+      off = adr & 0x00FFFFFF;
+
+#define SIM_PERI(base, len, reg)                                   \
+      if ((off >= ((base) & 0x00FFFFFF)) &&                        \
+          (off <  (((base) & 0x00FFFFFF) + (len))))                \
+         return (reg) + ((off - ((base) & 0x00FFFFFF)) / 4);
+
+      SIM_PERI(GPIO_BASE, GPIO_LEN, gpioReg)
+      SIM_PERI(SYST_BASE, SYST_LEN, systReg)
+      SIM_PERI(PWM_BASE,  PWM_LEN,  pwmReg)
+      SIM_PERI(PCM_BASE,  PCM_LEN,  pcmReg)
+
+#undef SIM_PERI
+
+      return NULL;
+   }
+
+   page = (adr - SIM_BUS_BASE) / PAGE_SIZE;
+
+   if ((adr < SIM_BUS_BASE) ||
+       (page >= (PAGES_PER_BLOCK * DMA_BLOCKS)))
+      return NULL;
+
+   return (volatile uint32_t *)
+      ((char *)dmaVirt[page] + ((adr - SIM_BUS_BASE) % PAGE_SIZE));
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int mySimWalkCbs(unsigned cycles, uint32_t *highPulses)
+{
+   /* Executes the input control blocks the way the DMA engine would,
+      one pulse per paced (timer fifo) write.  GPSET0/GPCLR0 are write
+      only on real hardware, so writes to them are folded into GPLEV0.
+   */
+
+   rawCbs_t * cb;
+   volatile uint32_t * src, * dst;
+   uint32_t adr, pulses, levels;
+   int gpio;
+
+   pulses = 0;
+
+   while (pulses < (cycles * PULSE_PER_CYCLE))
+   {
+      /* pick up any cpu writes since the last control block */
+
+      gpioReg[GPLEV0] |=  gpioReg[GPSET0];
+      gpioReg[GPLEV0] &= ~gpioReg[GPCLR0];
+      gpioReg[GPSET0] = 0;
+      gpioReg[GPCLR0] = 0;
+
+      adr = dmaIn[DMA_CONBLK_AD];
+
+      cb = (rawCbs_t *) mySimBusToVirt(adr);
+
+      if (cb == NULL) SOFT_ERROR(PI_BAD_SIM_CB, "bad cb address %08X", adr);
+
+      src = mySimBusToVirt(cb->src);
+      dst = mySimBusToVirt(cb->dst);
+
+      if ((src == NULL) || (dst == NULL))
+         SOFT_ERROR(PI_BAD_SIM_CB, "bad cb at %08X", adr);
+
+      if (src == (systReg + SYST_CLO)) mySystemTick();
+
+      *dst = *src;
+
+      if (cb->info & DMA_DEST_DREQ)
+      {
+         /* paced by the timer, one pulse has passed */
+
+         levels = gpioReg[GPLEV0];
+
+         if (highPulses)
+         {
+            for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+               if (levels & BIT) highPulses[gpio]++;
+         }
+
+         pulses++;
+      }
+
+      dmaIn[DMA_CONBLK_AD] = cb->next;
+   }
+
+   return pulses;
+}
+
 /* ======================================================================= */
 
 
@@ -4360,6 +5243,14 @@ static int initGrabLockFile(void)
 
 static uint32_t * initMapMem(int fd, uint32_t addr, uint32_t len)
 {
+    /* simulated peripherals are a zeroed in-memory register file */
+
+    if (gpioCfg.simulate)
+       return (uint32_t *) mmap(0, len,
+          PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS,
+          -1, 0);
+
     return (uint32_t *) mmap(0, len,
        PROT_READ|PROT_WRITE|PROT_EXEC,
        MAP_SHARED|MAP_LOCKED,
@@ -4372,6 +5263,8 @@ static int initCheckPermitted(void)
 {
    DBG(DBG_STARTUP, "");
 
+   if (gpioCfg.simulate) return 0;
+
    if ((fdMem = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
    {
       DBG(DBG_ALWAYS,
@@ -4605,6 +5498,47 @@ static int initMboxBlock(int block)
 
 /* ----------------------------------------------------------------------- */
 
+static int initSimBlock(int block)
+{
+   int n;
+   unsigned page;
+   char * virtualAdr;
+
+   DBG(DBG_STARTUP, "block=%d", block);
+
+   virtualAdr = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS,
+       -1, 0);
+
+   if (virtualAdr == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap sim block %d failed (%m)", block);
+
+   /* fake bus addresses, translated back by mySimBusToVirt */
+
+   page = block * PAGES_PER_BLOCK;
+
+   for (n=0; n<PAGES_PER_BLOCK; n++)
+   {
+      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
+      dmaBus[page+n] = (dmaPage_t *)(uintptr_t)
+         (SIM_BUS_BASE + ((page+n) * PAGE_SIZE));
+      virtualAdr += PAGE_SIZE;
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned stripWords(unsigned bytes)
+{
+   return ((bytes * 8 * STRIP_BITS_PER_BIT) + STRIP_RESET_BITS + 31) / 32;
+}
+
+/* ----------------------------------------------------------------------- */
+
 static int initAllocDMAMem(void)
 {
    int i, servoCycles, superCycles;
@@ -4628,6 +5562,17 @@ static int initAllocDMAMem(void)
 
    bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
 
+   shadowBlocks = gpioCfg.doubleBuffer ? bufferBlocks : 0;
+
+   stripDataPages = (stripWords(gpioCfg.stripBytes) + STRIP_WORDS_PER_PAGE - 1)
+      / STRIP_WORDS_PER_PAGE;
+
+   if (gpioCfg.stripBytes)
+      stripBlocks = ((2 * (1 + stripDataPages)) + PAGES_PER_BLOCK - 1)
+         / PAGES_PER_BLOCK;
+   else
+      stripBlocks = 0;
+
    DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d",
       gpioCfg.bufferMilliseconds, gpioCfg.clockMicros,
       bufferBlocks, bufferCycles);
@@ -4635,7 +5580,7 @@ static int initAllocDMAMem(void)
    /* allocate memory for pointers to virtual and bus memory pages */
 
    dmaVirt = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+       0, PAGES_PER_BLOCK*DMA_BLOCKS*sizeof(dmaPage_t *),
        PROT_READ|PROT_WRITE,
        MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
        -1, 0);
@@ -4644,7 +5589,7 @@ static int initAllocDMAMem(void)
       SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
 
    dmaBus = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+       0, PAGES_PER_BLOCK*DMA_BLOCKS*sizeof(dmaPage_t *),
        PROT_READ|PROT_WRITE,
        MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
        -1, 0);
@@ -4658,14 +5603,40 @@ static int initAllocDMAMem(void)
    dmaOVirt = (dmaOPage_t **)(dmaVirt + (PAGES_PER_BLOCK*bufferBlocks));
    dmaOBus  = (dmaOPage_t **)(dmaBus  + (PAGES_PER_BLOCK*bufferBlocks));
 
-   if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
+   if (shadowBlocks)
+   {
+      dmaSVirt = (dmaIPage_t **)
+         (dmaVirt + (PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)));
+      dmaSBus  = (dmaIPage_t **)
+         (dmaBus  + (PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)));
+   }
+
+   if (stripBlocks)
+   {
+      stripVirt = dmaVirt +
+         (PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS+shadowBlocks));
+      stripBus  = dmaBus  +
+         (PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS+shadowBlocks));
+   }
+
+   if (gpioCfg.simulate)
+   {
+      /* ordinary memory, nothing but the simulator will read it */
+
+      for (i=0; i<DMA_BLOCKS; i++)
+      {
+         status = initSimBlock(i);
+         if (status < 0) return status;
+      }
+   }
+   else if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
        ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) &&
         (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS)))
    {
       /* pagemap allocation of DMA memory */
 
       dmaPMapBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+          0, DMA_BLOCKS*sizeof(dmaPage_t *),
           PROT_READ|PROT_WRITE,
           MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
           -1, 0);
@@ -4678,7 +5649,7 @@ static int initAllocDMAMem(void)
       if (fdPmap < 0)
          SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      for (i=0; i<DMA_BLOCKS; i++)
       {
          status = initPagemapBlock(i);
          if (status < 0)
@@ -4698,7 +5669,7 @@ static int initAllocDMAMem(void)
       /* mailbox allocation of DMA memory */
 
       dmaMboxBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t),
+          0, DMA_BLOCKS*sizeof(DMAMem_t),
           PROT_READ|PROT_WRITE,
           MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
           -1, 0);
@@ -4711,7 +5682,7 @@ static int initAllocDMAMem(void)
       if (fdMbox < 0)
          SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      for (i=0; i<DMA_BLOCKS; i++)
       {
          status = initMboxBlock(i);
          if (status < 0)
@@ -4978,6 +5949,7 @@ static void initClearGlobals(void)
    for (i=0; i<=PI_MAX_USER_GPIO; i++)
    {
       wfRx[i].mode         = PI_WFRX_NONE;
+      pwmRamped[i]         = 0;
    }
 
    for (i=0; i<=PI_MAX_GPIO; i++)
@@ -5065,32 +6037,32 @@ static void initReleaseResources(void)
    if (dmaBus != MAP_FAILED)
    {
       munmap(dmaBus,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+         PAGES_PER_BLOCK*DMA_BLOCKS*sizeof(dmaPage_t *));
    }
 
    dmaBus = MAP_FAILED;
 
    if (dmaVirt != MAP_FAILED)
    {
-      for (i=0; i<PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      for (i=0; i<PAGES_PER_BLOCK*DMA_BLOCKS; i++)
       {
          munmap(dmaVirt[i], PAGE_SIZE);
       }
 
       munmap(dmaVirt,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+         PAGES_PER_BLOCK*DMA_BLOCKS*sizeof(dmaPage_t *));
    }
 
    dmaVirt = MAP_FAILED;
 
    if (dmaPMapBlk != MAP_FAILED)
    {
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      for (i=0; i<DMA_BLOCKS; i++)
       {
          munmap(dmaPMapBlk[i], PAGES_PER_BLOCK*PAGE_SIZE);
       }
 
-      munmap(dmaPMapBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+      munmap(dmaPMapBlk, DMA_BLOCKS*sizeof(dmaPage_t *));
    }
 
    dmaPMapBlk = MAP_FAILED;
@@ -5099,14 +6071,14 @@ static void initReleaseResources(void)
    {
       fdMbox = mbOpen();
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      for (i=0; i<DMA_BLOCKS; i++)
       {
-         mbDMAFree(&dmaMboxBlk[bufferBlocks+PI_WAVE_BLOCKS-i-1]);
+         mbDMAFree(&dmaMboxBlk[DMA_BLOCKS-i-1]);
       }
 
       mbClose(fdMbox);
 
-      munmap(dmaMboxBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t));
+      munmap(dmaMboxBlk, DMA_BLOCKS*sizeof(DMAMem_t));
    }
 
    dmaMboxBlk = MAP_FAILED;
@@ -5176,10 +6148,13 @@ int initInitialise(void)
 
    if (initCheckPermitted() < 0) return PI_INIT_FAILED;
 
-   fdLock = initGrabLockFile();
+   if (!gpioCfg.simulate)
+   {
+      fdLock = initGrabLockFile();
 
-   if (fdLock < 0)
-      SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
+      if (fdLock < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
+   }
 
    if (!gpioMaskSet)
    {
@@ -5429,6 +6404,8 @@ void gpioTerminate(void)
 
    if (dmaReg != MAP_FAILED) dmaIn[DMA_CS] = DMA_CHANNEL_RESET;
    if (dmaReg != MAP_FAILED) dmaOut[DMA_CS] = DMA_CHANNEL_RESET;
+   if (stripGpio >= 0) dmaStrip[DMA_CS] = DMA_CHANNEL_RESET;
+   stripGpio = -1;
 
 #ifndef EMBEDDED_IN_VM
    if (gpioCfg.internals & PI_CFG_STATS)
@@ -5556,119 +6533,501 @@ int gpioSetMode(unsigned gpio, unsigned mode)
 
 /* ----------------------------------------------------------------------- */
 
-int gpioGetMode(unsigned gpio)
-{
-   int reg, shift;
+int gpioGetMode(unsigned gpio)
+{
+   int reg, shift;
+
+   DBG(DBG_USER, "gpio=%d", gpio);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
+
+   return (gpioReg[reg] >> shift) & 7;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSetPullUpDown(unsigned gpio, unsigned pud)
+{
+   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+
+   if (pud > PI_PUD_UP)
+      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
+
+   *(gpioReg + GPPUD) = pud;
+
+   myGpioDelay(20);
+
+   *(gpioReg + GPPUDCLK0 + BANK) = BIT;
+
+   myGpioDelay(20);
+
+   *(gpioReg + GPPUD) = 0;
+
+   *(gpioReg + GPPUDCLK0 + BANK) = 0;
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioRead(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+
+   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
+   else                                         return PI_OFF;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWrite(unsigned gpio, unsigned level)
+{
+   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+
+   if (level > PI_ON)
+      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
+
+   if (gpio <= PI_MAX_GPIO)
+   {
+      if (gpioInfo[gpio].is != GPIO_WRITE)
+      {
+         /* stop a glitch between setting mode then level */
+         if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
+         else                 *(gpioReg + GPSET0 + BANK) = BIT;
+
+         switchFunctionOff(gpio);
+
+         gpioSetMode(gpio, PI_OUTPUT);
+
+         gpioInfo[gpio].is = GPIO_WRITE;
+      }
+   }
+
+   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
+   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioPWM(unsigned gpio, unsigned val)
+{
+   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (val > gpioInfo[gpio].range)
+      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
+
+   if (gpioInfo[gpio].is != GPIO_PWM)
+   {
+      switchFunctionOff(gpio);
+
+      gpioSetMode(gpio, PI_OUTPUT);
+
+      gpioInfo[gpio].is = GPIO_PWM;
+   }
+
+   myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+
+   gpioInfo[gpio].width=val;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myApplyPwmMulti(dmaIPage_t * * virt)
+{
+   int n, pos, page, slot;
+
+   for (n=0; n<pwmMultiOffCount; n++)
+   {
+      pos = pwmMultiOffPos[n];
+
+      myOffPageSlot(pos, &page, &slot);
+
+      virt[page]->gpioOff[slot] =
+         (virt[page]->gpioOff[slot] & ~pwmMultiOffClr[pos]) |
+         pwmMultiOffSet[pos];
+   }
+
+   for (n=0; n<pwmMultiOnCount; n++)
+   {
+      pos = pwmMultiOnPos[n];
+
+      page = pos/ON_PER_IPAGE;
+      slot = pos%ON_PER_IPAGE;
+
+      virt[page]->gpioOn[slot] =
+         (virt[page]->gpioOn[slot] & ~pwmMultiOnClr[pos]) |
+         pwmMultiOnSet[pos];
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myClearPwmMulti(void)
+{
+   int n, pos;
+
+   for (n=0; n<pwmMultiOffCount; n++)
+   {
+      pos = pwmMultiOffPos[n];
+
+      pwmMultiOffSet[pos] = 0;
+      pwmMultiOffClr[pos] = 0;
+   }
+
+   for (n=0; n<pwmMultiOnCount; n++)
+   {
+      pos = pwmMultiOnPos[n];
+
+      pwmMultiOnSet[pos] = 0;
+      pwmMultiOnClr[pos] = 0;
+   }
+
+   pwmMultiOffCount = 0;
+   pwmMultiOnCount = 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int myQueueFrame(uint32_t stopped)
+{
+   /* Stages the gathered changes in the ring the DMA engine is not
+      running and relinks the end of the cycle after next into it, so
+      every gpio changes at the same cycle boundary.  The ring left
+      behind is caught up by dmaFlushFrame.
+   */
+
+   int cb, ring, cycle, page, slot;
+
+   if (!(dmaIn[DMA_CS] & DMA_ACTIVATE)) return 0;
+
+   if (dmaFindCb(dmaIn[DMA_CONBLK_AD], &ring) < 0) return 0;
+
+   myApplyPwmMulti(dmaRingVirt(!ring));
+
+   /* the switch must not be overtaken by the DMA engine, so only
+      now see how far it has got
+   */
+
+   cb = dmaFindCb(dmaIn[DMA_CONBLK_AD], NULL);
+
+   cycle = (cb < 0) ? 0 : cb / CBS_PER_CYCLE;
+
+   if (stopped)
+   {
+      /* a stopped gpio may be high when the switch happens and the
+         new ring has no slot left to clear it
+      */
+
+      frameStopPos = (((cycle+3) * PULSE_PER_CYCLE) % SUPERLEVEL) + 1;
+
+      myOffPageSlot(frameStopPos, &page, &slot);
+
+      dmaRingVirt(!ring)[page]->gpioOff[slot] |= stopped;
+   }
+
+   frameRing    = ring;
+   frameLinkCb  = (((cycle+2) % bufferCycles) * CBS_PER_CYCLE) +
+                  CBS_PER_CYCLE - 1;
+   frameStopped = stopped;
+   frameQueued  = 1;
+
+   dmaRingCb(ring, frameLinkCb)->next =
+      dmaRingCbAdr(!ring, ((cycle+3) % bufferCycles) * CBS_PER_CYCLE);
+
+   return 1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaFlushFrame(void)
+{
+   /* Catches the ring left behind by the last queued frame up and
+      restores its own link, after which both rings match again.
+   */
+
+   int ring, tries, page, slot;
+
+   if (!frameQueued) return;
+
+   frameQueued = 0;
+
+   if (!gpioCfg.simulate)
+   {
+      /* the switch is at most a few cycles away */
+
+      for (tries=0; tries<4; tries++)
+      {
+         if ((dmaFindCb(dmaIn[DMA_CONBLK_AD], &ring) < 0) ||
+             (ring != frameRing)) break;
+
+         myGpioDelay(PULSE_PER_CYCLE * gpioCfg.clockMicros);
+      }
+   }
+
+   dmaRingCb(frameRing, frameLinkCb)->next =
+      dmaRingCbAdr(frameRing, (frameLinkCb+1) % NUM_CBS);
+
+   myApplyPwmMulti(dmaRingVirt(frameRing));
+
+   myClearPwmMulti();
+
+   if (frameStopped)
+   {
+      myOffPageSlot(frameStopPos, &page, &slot);
+
+      dmaIVirt[page]->gpioOff[slot] &= ~frameStopped;
+      dmaSVirt[page]->gpioOff[slot] &= ~frameStopped;
+
+      /* the engine may not have reached the slot yet, or never
+         switched, and neither ring sets a stopped gpio any more
+      */
+
+      *(gpioReg + GPCLR0) = frameStopped;
+      *(gpioReg + GPCLR0) = frameStopped;
+
+      frameStopped = 0;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioPWMMulti(uint32_t gpios, const unsigned *dutycycles)
+{
+   unsigned gpio, val;
+   int newOff, oldOff, realRange, cycles, i;
+   uint32_t stopped;
+
+   DBG(DBG_USER, "gpios=%08X", gpios);
+
+   CHECK_INITED;
+
+   for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+   {
+      if ((gpios & BIT) && (dutycycles[gpio] > gpioInfo[gpio].range))
+         SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)",
+            gpio, dutycycles[gpio]);
+   }
+
+   /* the gather tables may still hold the previous frame */
+
+   dmaFlushFrame();
+
+   stopped = 0;
+
+   /* gather the changes of every gpio per slot */
+
+#define MULTI_MARK(table, p)                                        \
+   do                                                                \
+   {                                                                 \
+      if (!(table##Set[p] | table##Clr[p]))                          \
+         table##Pos[table##Count++] = p;                             \
+   }                                                                 \
+   while (0)
+
+   for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+   {
+      if (!(gpios & BIT)) continue;
+
+      val = dutycycles[gpio];
+
+      if (gpioInfo[gpio].is != GPIO_PWM)
+      {
+         switchFunctionOff(gpio);
+
+         gpioSetMode(gpio, PI_OUTPUT);
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+         gpioInfo[gpio].is = GPIO_PWM;
+      }
 
-   CHECK_INITED;
+      if (pwmRamped[gpio])
+      {
+         myGpioEndRamp(gpio, val);
+         gpioInfo[gpio].width = val;
+         continue;
+      }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+      realRange = pwmRealRange[gpioInfo[gpio].freqIdx];
+      cycles    = pwmCycles   [gpioInfo[gpio].freqIdx];
 
-   reg   =  gpio/10;
-   shift = (gpio%10) * 3;
+      newOff = (val * realRange)/gpioInfo[gpio].range;
+      oldOff = (gpioInfo[gpio].width * realRange)/gpioInfo[gpio].range;
 
-   return (gpioReg[reg] >> shift) & 7;
-}
+      gpioInfo[gpio].width = val;
 
+      if (newOff == oldOff) continue;
 
-/* ----------------------------------------------------------------------- */
+      for (i=0; i<SUPERLEVEL; i+=realRange)
+      {
+         if (newOff)
+         {
+            MULTI_MARK(pwmMultiOff, i+newOff);
+            pwmMultiOffSet[i+newOff] |= BIT;
+         }
 
-int gpioSetPullUpDown(unsigned gpio, unsigned pud)
-{
-   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
+         if (oldOff)
+         {
+            MULTI_MARK(pwmMultiOff, i+oldOff);
+            pwmMultiOffClr[i+oldOff] |= BIT;
+         }
+      }
 
-   CHECK_INITED;
+      if (newOff && !oldOff)                     /* PWM START */
+      {
+         for (i=0; i<SUPERCYCLE; i+=cycles)
+         {
+            MULTI_MARK(pwmMultiOn, i);
+            pwmMultiOnSet[i] |= BIT;
+         }
+      }
+      else if (!newOff)                          /* PWM STOP */
+      {
+         for (i=0; i<SUPERCYCLE; i+=cycles)
+         {
+            MULTI_MARK(pwmMultiOn, i);
+            pwmMultiOnClr[i] |= BIT;
+         }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+         stopped |= BIT;
+      }
+   }
 
-   if (pud > PI_PUD_UP)
-      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
+#undef MULTI_MARK
 
-   *(gpioReg + GPPUD) = pud;
+   /* with a shadow ring all gpios change at one cycle boundary,
+      otherwise each touched slot is written once
+   */
 
-   myGpioDelay(20);
+   if (shadowBlocks && myQueueFrame(stopped)) return 0;
 
-   *(gpioReg + GPPUDCLK0 + BANK) = BIT;
+   myApplyPwmMulti(dmaIVirt);
 
-   myGpioDelay(20);
+   if (shadowBlocks) myApplyPwmMulti(dmaSVirt);
 
-   *(gpioReg + GPPUD) = 0;
+   myClearPwmMulti();
 
-   *(gpioReg + GPPUDCLK0 + BANK) = 0;
+   if (stopped)
+   {
+      *(gpioReg + GPCLR0) = stopped;
+      *(gpioReg + GPCLR0) = stopped;
+   }
 
    return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioRead(unsigned gpio)
+int gpioPWMRamp(unsigned gpio, unsigned startVal, unsigned endVal)
 {
-   DBG(DBG_USER, "gpio=%d", gpio);
+   int cycles, periods, first, i;
+   unsigned val, realRange;
+   uint32_t num, off, err;
+
+   DBG(DBG_USER, "gpio=%d start=%d end=%d", gpio, startVal, endVal);
 
    CHECK_INITED;
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
-   else                                         return PI_OFF;
-}
+   if (startVal > gpioInfo[gpio].range)
+      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, startVal);
 
+   if (endVal > gpioInfo[gpio].range)
+      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, endVal);
 
-/* ----------------------------------------------------------------------- */
+   if (gpioInfo[gpio].is != GPIO_PWM)
+   {
+      switchFunctionOff(gpio);
 
-int gpioWrite(unsigned gpio, unsigned level)
-{
-   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
+      gpioSetMode(gpio, PI_OUTPUT);
 
-   CHECK_INITED;
+      gpioInfo[gpio].is = GPIO_PWM;
+   }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   cycles    = pwmCycles   [gpioInfo[gpio].freqIdx];
+   realRange = pwmRealRange[gpioInfo[gpio].freqIdx];
+   periods   = SUPERCYCLE / cycles;
 
-   if (level > PI_ON)
-      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
+   myGpioBeginRamp(gpio);
 
-   if (gpio <= PI_MAX_GPIO)
+   /* start with the period after the one being played, finish with it */
+
+   first = ((dmaCurrentCycle() % SUPERCYCLE) / cycles) + 1;
+
+   err = 0;
+
+   for (i=0; i<periods; i++)
    {
-      if (gpioInfo[gpio].is != GPIO_WRITE)
-      {
-         /* stop a glitch between setting mode then level */
-         if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-         else                 *(gpioReg + GPSET0 + BANK) = BIT;
+      val = startVal +
+         ((((int)endVal - (int)startVal) * (i+1)) / periods);
 
-         switchFunctionOff(gpio);
+      /* carry what truncation to the real range loses into the next step */
 
-         gpioSetMode(gpio, PI_OUTPUT);
+      num = (val * realRange) + err;
+      off = num / gpioInfo[gpio].range;
+      err = num - (off * gpioInfo[gpio].range);
 
-         gpioInfo[gpio].is = GPIO_WRITE;
-      }
+      myGpioSetPwmPeriod(gpio, (first+i) % periods, off);
    }
 
-   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   gpioInfo[gpio].width = endVal;
 
-   return 0;
+   return SUPERCYCLE * PULSE_PER_CYCLE * gpioCfg.clockMicros;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioPWM(unsigned gpio, unsigned val)
+int gpioPWMDither(unsigned gpio, unsigned val, unsigned range)
 {
-   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
+   int periods, i;
+   unsigned realRange;
+   uint32_t num, off, err;
+
+   DBG(DBG_USER, "gpio=%d dutycycle=%d range=%d", gpio, val, range);
 
    CHECK_INITED;
 
    if (gpio > PI_MAX_USER_GPIO)
       SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if (val > gpioInfo[gpio].range)
+   if ((range < PI_MIN_DUTYCYCLE_RANGE) || (range > PI_MAX_DITHER_RANGE))
+      SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
+
+   if (val > range)
       SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
 
    if (gpioInfo[gpio].is != GPIO_PWM)
@@ -5680,9 +7039,26 @@ int gpioPWM(unsigned gpio, unsigned val)
       gpioInfo[gpio].is = GPIO_PWM;
    }
 
-   myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+   realRange = pwmRealRange[gpioInfo[gpio].freqIdx];
+   periods   = SUPERCYCLE / pwmCycles[gpioInfo[gpio].freqIdx];
 
-   gpioInfo[gpio].width=val;
+   myGpioBeginRamp(gpio);
+
+   /* first order sigma-delta, the off positions average out to val/range */
+
+   err = 0;
+
+   for (i=0; i<periods; i++)
+   {
+      num = (val * realRange) + err;
+      off = num / range;
+      err = num - (off * range);
+
+      myGpioSetPwmPeriod(gpio, i, off);
+   }
+
+   gpioInfo[gpio].width =
+      ((val * gpioInfo[gpio].range) + (range / 2)) / range;
 
    return 0;
 }
@@ -6444,6 +7820,9 @@ int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode)
 
    if (!waveClockInited)
    {
+      if (stripGpio >= 0)
+         SOFT_ERROR(PI_STRIP_IN_USE, "illegal, PWM in use for pixel strip");
+
       stopHardwarePWM();
       initClock(0); /* initialise secondary clock */
       waveClockInited = 1;
@@ -6668,6 +8047,9 @@ int gpioWaveChain(char *buf, unsigned bufSize)
 
    if (!waveClockInited)
    {
+      if (stripGpio >= 0)
+         SOFT_ERROR(PI_STRIP_IN_USE, "illegal, PWM in use for pixel strip");
+
       stopHardwarePWM();
       initClock(0); /* initialise secondary clock */
       waveClockInited = 1;
@@ -7874,6 +9256,9 @@ int gpioHardwarePWM(
    if (gpioCfg.clockPeriph == PI_CLOCK_PWM)
       SOFT_ERROR(PI_HPWM_ILLEGAL, "illegal, PWM in use for main clock");
 
+   if (stripGpio >= 0)
+      SOFT_ERROR(PI_STRIP_IN_USE, "illegal, PWM in use for pixel strip");
+
    pwm = (PWMDef[gpio] >> 4) & 3;
    mode  = PWMDef[gpio] & 7;
 
@@ -7882,6 +9267,20 @@ int gpioHardwarePWM(
       real_range = ((double)CLK_PLLD_FREQ / (2.0 * frequency)) + 0.5;
       real_dutycycle = ((uint64_t)dutycycle * real_range) / PI_HW_PWM_RANGE;
 
+      if ((gpioInfo[gpio].is == GPIO_HW_PWM) &&
+          (hw_pwm_real_range[pwm] == real_range) &&
+          (!waveClockInited))
+      {
+         /* same clock and range, only the dutycycle changes */
+
+         hw_pwm_duty[pwm] = dutycycle;
+
+         if (pwm == 0) pwmReg[PWM_DAT1] = real_dutycycle;
+         else          pwmReg[PWM_DAT2] = real_dutycycle;
+
+         return 0;
+      }
+
       /* record the set PWM frequency and dutycycle */
 
       hw_pwm_freq[pwm] =
@@ -8038,14 +9437,14 @@ uint32_t gpioDelay(uint32_t micros)
 
    CHECK_INITED;
 
-   start = systReg[SYST_CLO];
+   start = mySystemTick();
 
    if (micros <= PI_MAX_BUSY_DELAY)
-      while ((systReg[SYST_CLO] - start) <= micros);
+      while ((mySystemTick() - start) <= micros);
    else
       gpioSleep(PI_TIME_RELATIVE, (micros/MILLION), (micros%MILLION));
 
-   return (systReg[SYST_CLO] - start);
+   return (mySystemTick() - start);
 }
 
 
@@ -8055,7 +9454,7 @@ uint32_t gpioTick(void)
 {
    CHECK_INITED;
 
-   return systReg[SYST_CLO];
+   return mySystemTick();
 }
 
 
@@ -8247,6 +9646,51 @@ int gpioCfgMemAlloc(unsigned memAllocMode)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgSimulation(unsigned simulate)
+{
+   DBG(DBG_USER, "simulate=%d", simulate);
+
+   CHECK_NOT_INITED;
+
+   gpioCfg.simulate = (simulate != 0);
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgDoubleBuffer(unsigned enable)
+{
+   DBG(DBG_USER, "enable=%d", enable);
+
+   CHECK_NOT_INITED;
+
+   gpioCfg.doubleBuffer = (enable != 0);
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgStrip(unsigned bytes)
+{
+   DBG(DBG_USER, "bytes=%d", bytes);
+
+   CHECK_NOT_INITED;
+
+   if (bytes > PI_MAX_STRIP_BYTES)
+      SOFT_ERROR(PI_BAD_PARAM, "bad strip bytes (%d)", bytes);
+
+   gpioCfg.stripBytes = bytes;
+
+   return 0;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 uint32_t gpioCfgGetInternals(void)
@@ -8299,3 +9743,186 @@ int gpioCfgInternals(unsigned cfgWhat, unsigned cfgVal)
 
    return retVal;
 }
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSimStep(unsigned cycles, uint32_t *highPulses)
+{
+   DBG(DBG_USER, "cycles=%d", cycles);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.simulate)
+      SOFT_ERROR(PI_NOT_SIMULATED, "not simulated");
+
+   if (!(dmaIn[DMA_CS] & DMA_ACTIVATE)) return 0;
+
+   return mySimWalkCbs(cycles, highPulses);
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSimSpiRead(char *buf, unsigned count, unsigned *transfers)
+{
+   DBG(DBG_USER, "count=%d", count);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.simulate)
+      SOFT_ERROR(PI_NOT_SIMULATED, "not simulated");
+
+   if (count > spiSimCount) count = spiSimCount;
+
+   memcpy(buf, spiSimBuf, count);
+
+   if (transfers) *transfers = spiSimTransfers;
+
+   spiSimTransfers = 0;
+
+   return spiSimCount;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSimI2cRead(
+   unsigned i2cBus, unsigned i2cAddr, unsigned reg, char *buf, unsigned count)
+{
+   unsigned i;
+
+   DBG(DBG_USER, "i2cBus=%d i2cAddr=%d reg=%d count=%d",
+      i2cBus, i2cAddr, reg, count);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.simulate)
+      SOFT_ERROR(PI_NOT_SIMULATED, "not simulated");
+
+   if (i2cBus >= PI_NUM_I2C_BUS)
+      SOFT_ERROR(PI_BAD_I2C_BUS, "bad I2C bus (%d)", i2cBus);
+
+   if (i2cAddr > PI_MAX_I2C_ADDR)
+      SOFT_ERROR(PI_BAD_I2C_ADDR, "bad I2C address (%d)", i2cAddr);
+
+   if ((reg > 0xFF) || (count > 256))
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d) or count (%d)", reg, count);
+
+   for (i=0; i<count; i++) buf[i] = i2cSimReg[i2cBus][i2cAddr][(reg + i) & 0xFF];
+
+   return count;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSimI2cTraffic(unsigned i2cBus, unsigned *bytes)
+{
+   int transactions;
+
+   DBG(DBG_USER, "i2cBus=%d", i2cBus);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.simulate)
+      SOFT_ERROR(PI_NOT_SIMULATED, "not simulated");
+
+   if (i2cBus >= PI_NUM_I2C_BUS)
+      SOFT_ERROR(PI_BAD_I2C_BUS, "bad I2C bus (%d)", i2cBus);
+
+   transactions = i2cSimTransactions[i2cBus];
+
+   if (bytes) *bytes = i2cSimBytes[i2cBus];
+
+   i2cSimTransactions[i2cBus] = 0;
+   i2cSimBytes[i2cBus] = 0;
+
+   return transactions;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSimStripRead(char *buf, unsigned count)
+{
+   rawCbs_t * cb;
+   volatile uint32_t * src;
+   uint32_t adr, word, symbol;
+   unsigned w, bit, symbolBits, byteBits, byte, n;
+
+   DBG(DBG_USER, "count=%d", count);
+
+   CHECK_INITED;
+
+   if (!gpioCfg.simulate)
+      SOFT_ERROR(PI_NOT_SIMULATED, "not simulated");
+
+   if (stripGpio < 0)
+      SOFT_ERROR(PI_NO_STRIP, "no pixel strip open");
+
+   if (((pwmReg[PWM_CTL] & (PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1))
+        != (PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1)) ||
+       (pwmReg[PWM_RNG1] != 32))
+      SOFT_ERROR(PI_BAD_SIM_CB, "PWM not serialising its fifo");
+
+   n = 0;
+   byte = 0;
+   byteBits = 0;
+   symbol = 0;
+   symbolBits = 0;
+
+   /* follow the control blocks of the last frame shown the way the
+      DMA engine did, decoding the bits as a pixel would */
+
+   adr = dmaStrip[DMA_CONBLK_AD];
+
+   while (adr)
+   {
+      cb = (rawCbs_t *) mySimBusToVirt(adr);
+
+      if (cb == NULL) SOFT_ERROR(PI_BAD_SIM_CB, "bad cb address %08X", adr);
+
+      src = mySimBusToVirt(cb->src);
+
+      if ((src == NULL) || (cb->dst != PWM_TIMER) ||
+          ((cb->info & TIMED_DMA(31)) != TIMED_DMA(STRIP_PWM_DREQ)))
+         SOFT_ERROR(PI_BAD_SIM_CB, "bad cb at %08X", adr);
+
+      for (w=0; w<(cb->length/4); w++)
+      {
+         word = src[w];
+
+         for (bit=0; bit<32; bit++)
+         {
+            symbol = (symbol << 1) | ((word >> (31 - bit)) & 1);
+
+            if (++symbolBits < STRIP_BITS_PER_BIT) continue;
+
+            /* low throughout, the latch */
+            if (symbol == 0) return n;
+
+            if ((symbol != 4) && (symbol != 6))
+               SOFT_ERROR(PI_BAD_SIM_CB, "bad pixel bit %d", symbol);
+
+            byte = (byte << 1) | (symbol == 6);
+
+            if (++byteBits == 8)
+            {
+               if (n < count) buf[n] = byte;
+               n++;
+               byte = 0;
+               byteBits = 0;
+            }
+
+            symbol = 0;
+            symbolBits = 0;
+         }
+      }
+
+      adr = cb->next;
+   }
+
+   return n;
+}
+
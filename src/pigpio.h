@@ -157,6 +157,10 @@ ADVANCED
 
 gpioGetPWMrealRange        Get underlying PWM range for a gpio
 
+gpioPWMMulti               Set the PWM dutycycles of several gpios at once
+gpioPWMRamp                Queue a PWM dutycycle ramp in the DMA ring
+gpioPWMDither              Start PWM with a dithered fine dutycycle
+
 gpioSetAlertFuncEx         Request a gpio change callback, extended
 
 gpioSetISRFunc             Request a gpio interrupt callback
@@ -275,10 +279,18 @@ serClose                   Closes a serial device
 serWriteByte               Writes a byte to a serial device
 serReadByte                Reads a byte from a serial device
 serWrite                   Writes bytes to a serial device
+serBreak                   Sends a break on a serial device
 serRead                    Reads bytes from a serial device
 
 serDataAvailable           Returns number of bytes ready to be read
 
+PIXEL STRIP
+
+gpioStripOpen              Drives a WS2812/SK6812 strip from the PWM peripheral
+gpioStripWrite             Encodes a frame of pixel bytes
+gpioStripShow              Sends the last frame written
+gpioStripClose             Stops driving the strip
+
 CONFIGURATION
 
 gpioCfgBufferSize          Configure the gpio sample buffer size
@@ -289,12 +301,23 @@ gpioCfgPermissions         Configure the gpio access permissions
 gpioCfgInterfaces          Configure user interfaces
 gpioCfgSocketPort          Configure socket port
 gpioCfgMemAlloc            Configure DMA memory allocation mode
+gpioCfgSimulation          Configure simulated peripherals
+gpioCfgDoubleBuffer        Configure tear-free gpioPWMMulti frames
+gpioCfgStrip               Configure the pixel strip buffers
 
 gpioCfgInternals           Configure miscellaneous internals (DEPRECATED)
 
 gpioCfgGetInternals        Get internal configuration settings
 gpioCfgSetInternals        Set internal configuration settings
 
+SIMULATION
+
+gpioSimStep                Run the simulated DMA engine
+gpioSimStripRead           Decode the last pixel strip frame sent
+gpioSimSpiRead             Read back the last simulated SPI transfer
+gpioSimI2cRead             Read a simulated I2C slave's registers
+gpioSimI2cTraffic          Count the traffic on a simulated I2C bus
+
 CUSTOM
 
 gpioCustom1                User custom function 1
@@ -513,6 +536,7 @@ typedef void *(gpioThreadFunc_t) (void *);
 
 #define PI_MIN_DUTYCYCLE_RANGE        25
 #define PI_MAX_DUTYCYCLE_RANGE     40000
+#define PI_MAX_DITHER_RANGE        65535
 
 /* pulsewidth: 0, 500-2500 */
 
@@ -585,6 +609,14 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_SPI_SLOTS 16
 #define PI_SER_SLOTS 8
 
+/* serFlags */
+
+#define PI_SER_TWO_STOP_BITS 1
+
+/* gpioCfgStrip */
+
+#define PI_MAX_STRIP_BYTES 16384
+
 #define PI_NUM_I2C_BUS 2
 #define PI_MAX_I2C_ADDR 0x7F
 
@@ -895,6 +927,104 @@ gpioPWM(23, 0);   // Sets gpio23 full off.
 D*/
 
 
+/*F*/
+int gpioPWMMulti(uint32_t gpios, const unsigned *dutycycles);
+/*D
+Starts PWM on several gpios at once, as if by [*gpioPWM*] on each.
+
+. .
+     gpios: a bit mask of the gpios to set
+dutycycles: an array of 32 dutycycles indexed by gpio
+. .
+
+Returns 0 if OK, otherwise PI_BAD_DUTYCYCLE.
+
+Only the entries of dutycycles for gpios in the mask are read, and each
+must be within the range of its gpio (see [*gpioSetPWMrange*]).  Nothing
+changes unless all are.
+
+The new off and on slots of every gpio are worked out first and each
+slot of the DMA tables is then written once, so all the gpios change
+within one pass of the tables and slots shared by several gpios are
+not rewritten for each of them.
+
+If a shadow buffer has been configured (see [*gpioCfgDoubleBuffer*])
+all the gpios change at the same cycle boundary, a couple of cycles
+after the call.  Gpios with a ramp or dither pending change at once.
+
+...
+unsigned duty[32];
+
+duty[17] = 255;
+duty[18] = 128;
+
+gpioPWMMulti((1<<17)|(1<<18), duty); // gpio17 full on, gpio18 half on.
+...
+D*/
+
+
+/*F*/
+int gpioPWMRamp(unsigned user_gpio, unsigned startVal, unsigned endVal);
+/*D
+Writes a dutycycle ramp into the DMA ring so that each PWM period plays
+its own step without further CPU involvement.
+
+. .
+user_gpio: 0-31
+ startVal: 0-range
+   endVal: 0-range
+. .
+
+Returns the length of the ramp in microseconds if OK, otherwise
+PI_BAD_USER_GPIO or PI_BAD_DUTYCYCLE.
+
+The ramp begins with the PWM period after the one currently being
+played and moves in equal steps from startVal to endVal over one pass
+of the off slot table, 800 cycles of the sample rate (100 milliseconds
+at the default 5 microseconds).  After that the ramp plays again from
+the start, so call this again, or [*gpioPWM*] to hold a level, before
+it runs out.
+
+Calling [*gpioPWM*], [*gpioSetPWMrange*] or [*gpioSetPWMfrequency*]
+replaces the ramp with a steady dutycycle.
+
+...
+gpioPWMRamp(17, 0, 255); // Fades gpio17 on over 100ms.
+...
+D*/
+
+
+/*F*/
+int gpioPWMDither(unsigned user_gpio, unsigned dutycycle, unsigned range);
+/*D
+Starts PWM on the gpio with a dutycycle finer than its real range by
+varying the off position from one PWM period to the next.
+
+. .
+user_gpio: 0-31
+dutycycle: 0-range
+    range: 25-65535
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_DUTYRANGE, or
+PI_BAD_DUTYCYCLE.
+
+range is used for this call only and does not replace the range set by
+[*gpioSetPWMrange*].  A sigma-delta modulator spreads the fraction of a
+real range step over the PWM periods of one pass of the off slot table,
+so the dutycycle averaged over that pass (100 milliseconds at the
+default sample rate) is dutycycle/range to within one part in the real
+range times the number of periods.
+
+Calling [*gpioPWM*], [*gpioSetPWMrange*] or [*gpioSetPWMfrequency*]
+replaces the dithered dutycycle with a plain one.
+
+...
+gpioPWMDither(17, 1000, 65535); // Sets gpio17 to 1000/65535 on.
+...
+D*/
+
+
 /*F*/
 int gpioGetPWMdutycycle(unsigned user_gpio);
 /*D
@@ -2458,17 +2588,20 @@ with specified flags.
 . .
   sertty: the serial device to open, /dev/tty*
     baud: the baud rate in bits per second, see below
-serFlags: 0
+serFlags: 0 or PI_SER_TWO_STOP_BITS
 . .
 
 Returns a handle (>=0) if OK, otherwise PI_NO_HANDLE, or
 PI_SER_OPEN_FAILED.
 
-The baud rate must be one of 50, 75, 110, 134, 150,
+The baud rate may be one of 50, 75, 110, 134, 150,
 200, 300, 600, 1200, 1800, 2400, 4800, 9500, 19200,
-38400, 57600, 115200, or 230400.
+38400, 57600, 115200, or 230400, or any other rate up to
+4000000 the UART's clock can divide down to, such as DMX512's
+250000.
 
-No flags are currently defined.  This parameter should be set to zero.
+Characters are 8 data bits, no parity, and one stop bit, or two
+with PI_SER_TWO_STOP_BITS.
 D*/
 
 
@@ -2527,6 +2660,94 @@ PI_SER_WRITE_FAILED.
 D*/
 
 
+/*F*/
+int serBreak(unsigned handle, unsigned breakMicros, unsigned markMicros);
+/*D
+This function waits for the bytes written to the serial port
+associated with handle to be sent, then holds the line at space
+(a break) for breakMicros and at mark for markMicros microseconds.
+
+. .
+     handle: >=0, as returned by a call to [*serOpen*]
+breakMicros: 1-1000000
+ markMicros: 0-1000000
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_SER_WRITE_FAILED.
+
+The times are minimums, busy waited up to PI_MAX_BUSY_DELAY.  A
+break on a device without line control, such as a pseudo terminal,
+is only the wait.
+
+...
+serBreak(h, 100, 12); // DMX512 break and mark after break.
+serWrite(h, frame, 513);
+...
+D*/
+
+
+/*F*/
+int gpioStripOpen(unsigned gpio);
+/*D
+This function starts driving a strip of WS2812 or SK6812 pixels
+from PWM channel 1, serialising frames DMA feeds its fifo.
+
+. .
+gpio: 12 or 18
+. .
+
+Returns 0 if OK, otherwise PI_NO_STRIP, PI_BAD_STRIP_GPIO,
+PI_HPWM_ILLEGAL, or PI_BAD_PRIM_CHANNEL.
+
+The strip buffers must have been configured with [*gpioCfgStrip*],
+and the PWM peripheral must be free: the sample clock must come from
+PCM (see [*gpioCfgClock*]).  Hardware PWM is stopped, and hardware
+PWM and waves are refused until [*gpioStripClose*].
+
+The frames go out on DMA channel PI_DEFAULT_DMA_STRIP_CHANNEL.
+D*/
+
+
+/*F*/
+int gpioStripWrite(char *buf, unsigned count);
+/*D
+This function encodes count bytes of pixel data into the frame not
+being sent.
+
+. .
+  buf: the bytes in the order the pixels take them, e.g. GRB or GRBW
+count: 1-the configured strip bytes
+. .
+
+Returns 0 if OK, otherwise PI_NO_STRIP or PI_BAD_PARAM.
+
+A frame written but not yet shown is replaced.
+D*/
+
+
+/*F*/
+int gpioStripShow(void);
+/*D
+This function starts sending the frame last written, if any.
+
+Returns 0 if OK, otherwise PI_NO_STRIP or PI_STRIP_BUSY if the
+previous frame is still going out.
+
+A frame takes 30 microseconds a pixel of three bytes, 40 of four,
+plus 300 for the pixels to latch it.
+D*/
+
+
+/*F*/
+int gpioStripClose(void);
+/*D
+This function stops driving the strip and frees the PWM peripheral.
+
+Returns 0 if OK, otherwise PI_NO_STRIP.
+D*/
+
+
 /*F*/
 int serRead(unsigned handle, char *buf, unsigned count);
 /*D
@@ -2839,6 +3060,10 @@ There will only be a million steps for a PWMfreq of 250.
 Lower frequencies will have more steps and higher
 frequencies will have fewer steps.  PWMduty is
 automatically scaled to take this into account.
+
+Once a gpio is running hardware PWM, a call with the same PWMfreq
+only rewrites the channel's data register, so the dutycycle may be
+updated as often as needed without restarting the PWM clock.
 D*/
 
 /*F*/
@@ -3120,6 +3345,51 @@ Auto will use the mailbox method unless a larger than default buffer
 size is requested with [*gpioCfgBufferSize*].
 D*/
 
+/*F*/
+int gpioCfgSimulation(unsigned simulate);
+/*D
+Selects simulated peripherals.
+
+. .
+simulate: 0-1
+. .
+
+When simulating, the peripheral registers are an in-memory register
+file and DMA memory is ordinary memory, so the library may be
+initialised without root or a Pi.  Nothing executes the DMA control
+blocks until [*gpioSimStep*] is called.
+D*/
+
+/*F*/
+int gpioCfgDoubleBuffer(unsigned enable);
+/*D
+Configures a second, shadow, copy of the PWM DMA buffer.
+
+. .
+enable: 0-1
+. .
+
+With a shadow buffer [*gpioPWMMulti*] stages its changes in the copy
+the DMA engine is not running and relinks the engine into it at a
+cycle boundary, so all the gpios change in the same PWM period.
+
+The shadow buffer is as large as the primary buffer (see
+[*gpioCfgBufferSize*]).
+D*/
+
+/*F*/
+int gpioCfgStrip(unsigned bytes);
+/*D
+Configures DMA memory for two pixel strip frames, one sent while
+the next is written.
+
+. .
+bytes: 0-PI_MAX_STRIP_BYTES, the most a frame carries, 0 for none
+. .
+
+See [*gpioStripOpen*].
+D*/
+
 /*F*/
 int gpioCfgInternals(unsigned cfgWhat, unsigned cfgVal);
 /*D
@@ -3150,6 +3420,114 @@ cfgVal: see source code
 D*/
 
 
+/*F*/
+int gpioSimStep(unsigned cycles, uint32_t *highPulses);
+/*D
+Executes the DMA control blocks for a number of PWM cycles when
+simulating (see [*gpioCfgSimulation*]).
+
+. .
+    cycles: number of cycles to execute
+highPulses: an array of 32 counters, or NULL
+. .
+
+Returns the number of pulses executed if OK, otherwise
+PI_NOT_INITIALISED, PI_NOT_SIMULATED, or PI_BAD_SIM_CB.
+
+Each cycle is 25 pulses of the configured sample rate.  Writes to
+GPSET0 and GPCLR0 are folded into GPLEV0, so gpio levels may be read
+back with [*gpioRead_Bits_0_31*].  If highPulses is not NULL the
+counter for each gpio is incremented once for every pulse during which
+it was high, from which the achieved dutycycle may be worked out.
+
+...
+uint32_t high[32] = {0};
+
+gpioSimStep(800, high); // gpio 4 dutycycle is high[4] / 20000.0
+...
+D*/
+
+
+/*F*/
+int gpioSimStripRead(char *buf, unsigned count);
+/*D
+Decodes the last pixel strip frame shown when simulating (see
+[*gpioCfgSimulation*]), following its control blocks into the PWM
+fifo and reading the bits as a pixel would.
+
+. .
+  buf: an array to receive the bytes
+count: the most to store
+. .
+
+Returns the number of bytes in the frame if OK, otherwise
+PI_NOT_INITIALISED, PI_NOT_SIMULATED, PI_NO_STRIP, or PI_BAD_SIM_CB.
+
+Simulated, a frame is sent as soon as it is shown.
+D*/
+
+
+/*F*/
+int gpioSimSpiRead(char *buf, unsigned count, unsigned *transfers);
+/*D
+Reads back the bytes of the last SPI transfer when simulating (see
+[*gpioCfgSimulation*]).
+
+. .
+      buf: an array to receive the bytes
+    count: the most to store
+transfers: set to the number of transfers since the last call, or NULL
+. .
+
+Returns the number of bytes in the last transfer if OK, otherwise
+PI_NOT_INITIALISED or PI_NOT_SIMULATED.
+
+Simulated, every SPI channel shares one bus with MOSI looped back to
+MISO, so [*spiXfer*] reads back what it sends.
+D*/
+
+
+/*F*/
+int gpioSimI2cRead(
+   unsigned i2cBus, unsigned i2cAddr, unsigned reg, char *buf, unsigned count);
+/*D
+Reads the registers of a simulated I2C slave (see
+[*gpioCfgSimulation*]) without any bus traffic.
+
+. .
+ i2cBus: 0-1
+i2cAddr: 0-0x7F
+    reg: 0-255, the first register to read
+    buf: an array to receive the registers
+  count: 0-256, the number of registers to read
+. .
+
+Returns count if OK, otherwise PI_NOT_INITIALISED, PI_NOT_SIMULATED,
+PI_BAD_I2C_BUS, PI_BAD_I2C_ADDR, or PI_BAD_PARAM.
+
+Simulated, every address on a bus has a slave of 256 registers.  The
+first byte written to it sets its register pointer and each byte after
+is stored at the pointer, which then advances, as does each byte read.
+D*/
+
+
+/*F*/
+int gpioSimI2cTraffic(unsigned i2cBus, unsigned *bytes);
+/*D
+Counts the traffic on a simulated I2C bus (see [*gpioCfgSimulation*])
+since the last call.
+
+. .
+i2cBus: 0-1
+ bytes: set to the number of bytes clocked, address bytes included,
+        or NULL
+. .
+
+Returns the number of transactions, each from a start to a stop, if OK,
+otherwise PI_NOT_INITIALISED, PI_NOT_SIMULATED, or PI_BAD_I2C_BUS.
+D*/
+
+
 /*F*/
 int gpioCustom1(unsigned arg1, unsigned arg2, char *argx, unsigned argc);
 /*D
@@ -4469,6 +4847,12 @@ after this command is issued.
 #define PI_BAD_ISR_INIT    -123 // bad ISR initialisation
 #define PI_BAD_FOREVER     -124 // loop forever must be last chain command
 #define PI_BAD_FILTER      -125 // bad filter parameter
+#define PI_NOT_SIMULATED   -126 // library not configured for simulation
+#define PI_BAD_SIM_CB      -127 // simulated DMA hit a bad control block
+#define PI_STRIP_BUSY      -128 // pixel strip still sending a frame
+#define PI_NO_STRIP        -129 // pixel strip not configured or opened
+#define PI_BAD_STRIP_GPIO  -130 // gpio not 12 or 18
+#define PI_STRIP_IN_USE    -131 // illegal, PWM in use for pixel strip
 
 #define PI_PIGIF_ERR_0    -2000
 #define PI_PIGIF_ERR_99   -2099
@@ -4486,6 +4870,7 @@ after this command is issued.
 #define PI_DEFAULT_DMA_CHANNEL           14
 #define PI_DEFAULT_DMA_PRIMARY_CHANNEL   14
 #define PI_DEFAULT_DMA_SECONDARY_CHANNEL 5
+#define PI_DEFAULT_DMA_STRIP_CHANNEL     10
 #define PI_DEFAULT_SOCKET_PORT           8888
 #define PI_DEFAULT_SOCKET_PORT_STR       "8888"
 #define PI_DEFAULT_SOCKET_ADDR_STR       "127.0.0.1"